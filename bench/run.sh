@@ -0,0 +1,21 @@
+#!/bin/bash
+
+set -xue
+
+cd "$(dirname "$0")"
+
+# Host compiler; the byte loops must not be turned back into library calls
+# or vectorized, or the comparison is meaningless
+CC=${CC:-cc}
+CFLAGS="-std=gnu11 -O2 -fno-builtin -fno-tree-vectorize -fno-tree-loop-distribute-patterns"
+
+# Build common.c for the host with its functions renamed, so they do not
+# clash with the C library the benchmark links against. common.c treats
+# pointers as 32-bit, so link without PIE to keep the buffers below 4GB.
+$CC $CFLAGS -ffreestanding -nostdinc -Wno-pointer-to-int-cast -Wno-int-to-pointer-cast \
+    -Dmemcpy=k_memcpy -Dmemset=k_memset -Dstrcpy=k_strcpy -Dstrlen=k_strlen \
+    -Dstrcmp=k_strcmp -Dprintf=k_printf -Dputchar=k_putchar \
+    -c ../common.c -o common.o
+
+$CC $CFLAGS -no-pie -o memcpy_bench memcpy_bench.c common.o
+./memcpy_bench
@@ -2,9 +2,186 @@
 
 void putchar(char ch);
 
+/* Word type that may alias any object, for the word-at-a-time loops below */
+typedef uint32_t __attribute__((may_alias)) word_t;
+
+/* Set by the kernel at boot when the V extension is usable. Kept in .data
+ * because memset() reads it while .bss is being cleared. */
+__attribute__((section(".data")))
+bool has_vector = false;
+
+/* Below this size the scalar word loops beat setting up the vector unit */
+#define VECTOR_MIN_SIZE 64
+
+/* Vector registers, vl and vtype are not saved across traps, so a vector
+ * instruction must never fault: the page fault handler's own memcpy or
+ * memset would clobber v8 and vl before the instruction is retried. Kernel
+ * RAM is always mapped and qualifies; user buffers, which are paged in on
+ * demand and may be copy-on-write, take the scalar paths. */
+#define VECTOR_MIN_ADDR 0x80000000u
+
+static bool vec_safe(const void *p) {
+    return (uint32_t) p >= VECTOR_MIN_ADDR;
+}
+
+#ifdef __riscv
+/*
+ * RISC-V Vector (RVV) versions of the routines below. The rest of the code
+ * is built without V, so each asm block enables it locally. Elements are
+ * bytes grouped 8 registers at a time (e8, m8); vsetvli picks how many fit.
+ * strlen and strcmp use fault-only-first loads so they never fault past
+ * the terminating NUL.
+ */
+static void vec_memcpy(uint8_t *d, const uint8_t *s, size_t n) {
+    while (n > 0) {
+        size_t vl;
+        __asm__ __volatile__(
+            ".option push\n"
+            ".option arch, +v\n"
+            "vsetvli %0, %3, e8, m8, ta, ma\n"
+            "vle8.v v8, (%2)\n"
+            "vse8.v v8, (%1)\n"
+            ".option pop\n"
+            : "=&r"(vl)
+            : "r"(d), "r"(s), "r"(n)
+            : "memory"
+        );
+        d += vl;
+        s += vl;
+        n -= vl;
+    }
+}
+
+static void vec_memset(uint8_t *p, uint8_t c, size_t n) {
+    while (n > 0) {
+        size_t vl;
+        __asm__ __volatile__(
+            ".option push\n"
+            ".option arch, +v\n"
+            "vsetvli %0, %2, e8, m8, ta, ma\n"
+            "vmv.v.x v8, %3\n"
+            "vse8.v v8, (%1)\n"
+            ".option pop\n"
+            : "=&r"(vl)
+            : "r"(p), "r"(n), "r"(c)
+            : "memory"
+        );
+        p += vl;
+        n -= vl;
+    }
+}
+
+static size_t vec_strlen(const char *s) {
+    size_t len = 0;
+    while (1) {
+        size_t vl;
+        long first;
+        __asm__ __volatile__(
+            ".option push\n"
+            ".option arch, +v\n"
+            "vsetvli zero, %2, e8, m8, ta, ma\n"
+            "vle8ff.v v8, (%3)\n"
+            "csrr %0, vl\n"
+            "vmseq.vi v0, v8, 0\n"
+            "vfirst.m %1, v0\n"
+            ".option pop\n"
+            : "=&r"(vl), "=&r"(first)
+            : "r"(-1), "r"(s + len)
+            : "memory"
+        );
+        if (first >= 0)
+            return len + first;
+        len += vl;
+    }
+}
+
+static int vec_strcmp(const char *s1, const char *s2) {
+    while (1) {
+        size_t vl;
+        long first;
+        __asm__ __volatile__(
+            ".option push\n"
+            ".option arch, +v\n"
+            "vsetvli zero, %2, e8, m8, ta, ma\n"
+            "vle8ff.v v8, (%3)\n"
+            "vle8ff.v v16, (%4)\n"
+            "csrr %0, vl\n"
+            "vmsne.vv v0, v8, v16\n"
+            "vmseq.vi v1, v8, 0\n"
+            "vmor.mm v0, v0, v1\n"
+            "vfirst.m %1, v0\n"
+            ".option pop\n"
+            : "=&r"(vl), "=&r"(first)
+            : "r"(-1), "r"(s1), "r"(s2)
+            : "memory"
+        );
+        if (first >= 0)
+            return ((unsigned char *) s1)[first] - ((unsigned char *) s2)[first];
+        s1 += vl;
+        s2 += vl;
+    }
+}
+#else
+/* Host builds of this file (bench/) have no vector unit and never set
+ * has_vector, so these are never reached */
+#define vec_memcpy(d, s, n)     ((void) 0)
+#define vec_memset(p, c, n)     ((void) 0)
+#define vec_strlen(s)           0
+#define vec_strcmp(s1, s2)      0
+#endif
+
 void *memcpy(void *dst, const void *src, size_t n) {
     uint8_t *d = (uint8_t *) dst;   /* init byte pointer to dst buffer*/
     const uint8_t *s = (const uint8_t *) src;
+
+    if (has_vector && n >= VECTOR_MIN_SIZE && vec_safe(d) && vec_safe(s)) {
+        vec_memcpy(d, s, n);
+        return dst;
+    }
+
+    if (n >= 8) {
+        // Copy head bytes until dst is word-aligned
+        while ((uint32_t) d & 3) {
+            *d++ = *s++;
+            n--;
+        }
+
+        word_t *dw = (word_t *) d;
+        size_t words = n / 4;
+        if (((uint32_t) s & 3) == 0) {
+            // Same alignment: move 8 words per iteration, then single words
+            const word_t *sw = (const word_t *) s;
+            for (; words >= 8; words -= 8, dw += 8, sw += 8) {
+                dw[0] = sw[0];
+                dw[1] = sw[1];
+                dw[2] = sw[2];
+                dw[3] = sw[3];
+                dw[4] = sw[4];
+                dw[5] = sw[5];
+                dw[6] = sw[6];
+                dw[7] = sw[7];
+            }
+            for (; words > 0; words--)
+                *dw++ = *sw++;
+        } else {
+            // Different alignment: load aligned src words and merge each pair
+            // with shifts (little-endian). Aligned loads never cross a page.
+            uint32_t shift = ((uint32_t) s & 3) * 8;
+            const word_t *sw = (const word_t *) ((uint32_t) s & ~3u);
+            uint32_t cur = *sw++;
+            for (; words > 0; words--) {
+                uint32_t next = *sw++;
+                *dw++ = (cur >> shift) | (next << (32 - shift));
+                cur = next;
+            }
+        }
+
+        s += (uint8_t *) dw - d;
+        n -= (uint8_t *) dw - d;
+        d = (uint8_t *) dw;
+    }
+
+    // Copy the tail bytes
     while (n--)
         *d++ = *s++;
     return dst;
@@ -12,6 +189,38 @@ void *memcpy(void *dst, const void *src, size_t n) {
 
 void *memset(void *buf, char c, size_t n) {
     uint8_t *p = (uint8_t *) buf;
+
+    if (has_vector && n >= VECTOR_MIN_SIZE && vec_safe(p)) {
+        vec_memset(p, c, n);
+        return buf;
+    }
+
+    if (n >= 8) {
+        // Fill head bytes until p is word-aligned
+        while ((uint32_t) p & 3) {
+            *p++ = c;
+            n--;
+        }
+
+        // Fill 8 words per iteration, then single words
+        uint32_t word = (uint8_t) c * 0x01010101u;
+        word_t *pw = (word_t *) p;
+        for (; n >= 32; n -= 32, pw += 8) {
+            pw[0] = word;
+            pw[1] = word;
+            pw[2] = word;
+            pw[3] = word;
+            pw[4] = word;
+            pw[5] = word;
+            pw[6] = word;
+            pw[7] = word;
+        }
+        for (; n >= 4; n -= 4)
+            *pw++ = word;
+        p = (uint8_t *) pw;
+    }
+
+    // Fill the tail bytes
     while (n--)
         *p++ = c;
     return buf;
@@ -27,6 +236,9 @@ char *strcpy(char *dst, const char *src) {
 }
 
 size_t strlen(const char *s) {
+    if (has_vector && vec_safe(s))
+        return vec_strlen(s);
+
     size_t len = 0;
     while (*s++)
         len++;
@@ -34,6 +246,9 @@ size_t strlen(const char *s) {
 }
 
 int strcmp(const char *s1, const char *s2) {
+    if (has_vector && vec_safe(s1) && vec_safe(s2))
+        return vec_strcmp(s1, s2);
+
     while (*s1 && *s2) {
         if (*s1 != *s2)
             break;
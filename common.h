@@ -12,7 +12,9 @@ typedef uint32_t vaddr_t;
 #define true 1
 #define false 0
 #define NULL ((void *) 0)
+#define UINT64_MAX 0xffffffffffffffffULL
 #define align_up(value, align)      __builtin_align_up(value, align)
+#define align_down(value, align)    __builtin_align_down(value, align)
 #define is_aligned(value, align)    __builtin_is_aligned(value, align)
 #define offsetof(value, member)     __builtin_offsetof(value, member)
 #define va_list __builtin_va_list
@@ -25,6 +27,23 @@ typedef uint32_t vaddr_t;
 #define SYS_EXIT        3
 #define SYS_READFILE    4
 #define SYS_WRITEFILE   5
+#define SYS_FORK        6
+#define SYS_WRITE       7
+#define SYS_READ        8
+#define SYS_TTYMODE     9
+#define SYS_SETPRIORITY 10
+
+/* File descriptors accepted by SYS_READ and SYS_WRITE */
+#define STDIN_FILENO    0
+#define STDOUT_FILENO   1
+#define STDERR_FILENO   2
+
+/* Console input modes for SYS_TTYMODE */
+#define TTY_MODE_CANONICAL  0   // Line editing and echo; read returns whole lines
+#define TTY_MODE_RAW        1   // No echo; read returns whatever has been typed
+
+/* True once the kernel has enabled the vector unit (never in user mode) */
+extern bool has_vector;
 
 void *memset(void *buf, char c, size_t n);
 void *memcpy(void *dst, const void *src, size_t n);
@@ -0,0 +1,166 @@
+#include "console.h"
+#include "process.h"
+
+/* SBI extensions used by the console */
+#define SBI_EXT_BASE            0x10
+#define SBI_BASE_PROBE_EXT      3
+#define SBI_EXT_DBCN            0x4442434e  // "DBCN"
+#define SBI_DBCN_WRITE          0
+
+#define CONSOLE_BUF_SIZE        1024
+#define CONSOLE_IN_SIZE         64
+
+/* Control characters handled by the line discipline */
+#define CTRL_BS                 0x08
+#define CTRL_NAK                0x15    // ^U, kill line
+#define CTRL_DEL                0x7f
+
+/* Output ring buffer; head and tail are free-running byte counts */
+static char console_buf[CONSOLE_BUF_SIZE];
+static uint32_t console_head;
+static uint32_t console_tail;
+static bool dbcn_available;
+
+/* Input ring buffer, filled from the UART receive interrupt */
+static char input_buf[CONSOLE_IN_SIZE];
+static uint32_t input_head;
+static uint32_t input_tail;
+static struct wait_queue input_waiters;
+
+static int tty_mode = TTY_MODE_CANONICAL;
+static struct process *tty_raw_owner;  // Process that switched to raw mode
+
+void console_init(void) {
+    struct sbiret ret = sbi_call(SBI_EXT_DBCN, 0, 0, 0, 0, 0,
+                                 SBI_BASE_PROBE_EXT, SBI_EXT_BASE);
+    dbcn_available = ret.error == 0 && ret.value != 0;
+}
+
+void console_flush(void) {
+    while (console_tail != console_head) {
+        // Write the contiguous part up to the end of the ring in one call
+        uint32_t start = console_tail % CONSOLE_BUF_SIZE;
+        uint32_t len = console_head - console_tail;
+        if (len > CONSOLE_BUF_SIZE - start)
+            len = CONSOLE_BUF_SIZE - start;
+
+        if (dbcn_available) {
+            // The kernel is identity-mapped, so the buffer address is physical
+            struct sbiret ret = sbi_call(len, (uint32_t) &console_buf[start], 0, 0,
+                                         0, 0, SBI_DBCN_WRITE, SBI_EXT_DBCN);
+            if (ret.error == 0) {
+                console_tail += ret.value;
+                continue;
+            }
+        }
+
+        for (uint32_t i = 0; i < len; i++)
+            sbi_call(console_buf[start + i], 0, 0, 0, 0, 0, 0, 1 /* Console Putchar */);
+        console_tail += len;
+    }
+}
+
+void putchar(char ch) {
+    if (console_head - console_tail == CONSOLE_BUF_SIZE)
+        console_flush();
+
+    console_buf[console_head++ % CONSOLE_BUF_SIZE] = ch;
+    if (ch == '\n')
+        console_flush();
+}
+
+void console_write(const char *buf, size_t len) {
+    for (size_t i = 0; i < len; i++)
+        putchar(buf[i]);
+    console_flush();
+}
+
+int tty_set_mode(int mode) {
+    if (mode != TTY_MODE_CANONICAL && mode != TTY_MODE_RAW)
+        return -1;
+
+    int old = tty_mode;
+    tty_mode = mode;
+    tty_raw_owner = mode == TTY_MODE_RAW ? current_proc : NULL;
+    return old;
+}
+
+void tty_release(struct process *proc) {
+    if (tty_raw_owner == proc)
+        tty_set_mode(TTY_MODE_CANONICAL);
+}
+
+void console_receive(char ch) {
+    // Drop input nobody is reading rather than overwrite older keystrokes
+    if (input_head - input_tail < CONSOLE_IN_SIZE)
+        input_buf[input_head++ % CONSOLE_IN_SIZE] = ch;
+    wake_up(&input_waiters);
+}
+
+/**
+ * Takes the next buffered input character, or returns -1 if there is none.
+ */
+static long console_input(void) {
+    if (input_head == input_tail)
+        return -1;
+    return input_buf[input_tail++ % CONSOLE_IN_SIZE];
+}
+
+char console_getchar(void) {
+    while (1) {
+        long ch = console_input();
+        if (ch >= 0)
+            return ch;
+        sleep_on(&input_waiters);
+    }
+}
+
+int tty_read(char *buf, int len) {
+    if (len <= 0)
+        return 0;
+
+    if (tty_mode == TTY_MODE_RAW) {
+        // Block for the first character, then take whatever else is pending
+        int n = 0;
+        buf[n++] = console_getchar();
+        while (n < len) {
+            long ch = console_input();
+            if (ch < 0)
+                break;
+            buf[n++] = ch;
+        }
+        return n;
+    }
+
+    int n = 0;
+    while (n < len) {
+        char ch = console_getchar();
+        switch (ch) {
+            case '\r':
+            case '\n':
+                buf[n++] = '\n';
+                console_write("\n", 1);
+                return n;
+
+            case CTRL_BS:
+            case CTRL_DEL:
+                if (n > 0) {
+                    n--;
+                    console_write("\b \b", 3);
+                }
+                break;
+
+            case CTRL_NAK:
+                for (; n > 0; n--)
+                    console_write("\b \b", 3);
+                break;
+
+            default:
+                buf[n++] = ch;
+                console_write(&ch, 1);
+        }
+    }
+
+    // The line did not fit; the rest is returned by the next read
+    return n;
+}
@@ -0,0 +1,66 @@
+#pragma once
+#include "common.h"
+#include "kernel.h"
+
+/**
+ * Probes the SBI Debug Console extension used to drain the output buffer.
+ * Until this runs, output falls back to the legacy per-character call.
+ */
+void console_init(void);
+
+/**
+ * Appends a character to the kernel output buffer.
+ * The buffer is flushed on newline and whenever it fills up.
+ */
+void putchar(char ch);
+
+/**
+ * Writes a buffer to the console and flushes it.
+ *
+ * @param buf - Bytes to write
+ * @param len - Number of bytes
+ */
+void console_write(const char *buf, size_t len);
+
+/**
+ * Switches console input between canonical and raw mode.
+ *
+ * @param mode - TTY_MODE_CANONICAL or TTY_MODE_RAW
+ * @return The previous mode, or -1 if mode is invalid
+ */
+int tty_set_mode(int mode);
+
+/**
+ * Switches console input back to canonical mode if proc is the process
+ * that put it in raw mode. Called when a process exits.
+ *
+ * @param proc - Exiting process
+ */
+void tty_release(struct process *proc);
+
+/**
+ * Reads console input, sleeping while none is available.
+ * In canonical mode, input is echoed and edited (backspace, ^U) and a
+ * whole line ending in '\n' is returned. In raw mode, whatever has
+ * been typed is returned without echo.
+ *
+ * @param buf - Destination buffer
+ * @param len - Size of buf
+ * @return Number of bytes read
+ */
+int tty_read(char *buf, int len);
+
+/**
+ * Adds a received character to the input buffer and wakes processes
+ * sleeping on console input. Called from the UART interrupt handler.
+ *
+ * @param ch - Character received
+ */
+void console_receive(char ch);
+
+/**
+ * Reads a character of console input, sleeping until one arrives.
+ *
+ * @return The character
+ */
+char console_getchar(void);
@@ -1,10 +1,17 @@
 #include "fs.h"
 #include "virtio.h"
+#include "process.h"
 
 /* Global file table and disk buffer */
 struct file files[FILES_MAX];
 uint8_t disk[DISK_MAX_SIZE];
 
+/* Sleep lock for fs_flush(): the device reads disk[] directly, and the
+ * flushing process sleeps until it is done, so no other flush may rebuild
+ * the buffer in the meantime */
+static bool flush_busy;
+static struct wait_queue flush_waiters;
+
 /**
  * Converts an octal string to an integer.
  * Used for parsing TAR header fields (size, mode, etc.)
@@ -21,8 +28,7 @@ static int oct2int(char *oct, int len) {
 
 void fs_init(void) {
     // Load the entire disk into memory buffer
-    for (unsigned sector = 0; sector < sizeof(disk) / SECTOR_SIZE; sector++)
-        read_write_disk(&disk[sector * SECTOR_SIZE], sector, false);
+    blk_rw(disk, 0, sizeof(disk) / SECTOR_SIZE, false);
 
     // Parse TAR archive and populate file table
     unsigned off = 0;
@@ -47,6 +53,11 @@ void fs_init(void) {
 }
 
 void fs_flush(void) {
+    // Wait for any flush still writing disk[] out
+    while (flush_busy)
+        sleep_on(&flush_waiters);
+    flush_busy = true;
+
     // Rebuild TAR archive from in-memory files
     memset(disk, 0, sizeof(disk));
     unsigned off = 0;
@@ -89,10 +100,12 @@ void fs_flush(void) {
     }
 
     // Write entire disk buffer back to virtio-blk device
-    for (unsigned sector = 0; sector < sizeof(disk) / SECTOR_SIZE; sector++)
-        read_write_disk(&disk[sector * SECTOR_SIZE], sector, true);
+    blk_rw(disk, 0, sizeof(disk) / SECTOR_SIZE, true);
 
     printf("wrote %d bytes to disk\n", sizeof(disk));
+
+    flush_busy = false;
+    wake_up(&flush_waiters);
 }
 
 struct file *fs_lookup(const char *filename) {
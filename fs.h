@@ -11,6 +11,7 @@ void fs_init(void);
 /**
  * Writes all in-memory files back to disk.
  * Reconstructs the TAR format and writes to the virtio-blk device.
+ * Sleeps until the write completes; concurrent flushes run one at a time.
  */
 void fs_flush(void);
 
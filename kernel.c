@@ -5,10 +5,14 @@
 #include "fs.h"
 #include "process.h"
 #include "trap.h"
+#include "console.h"
+#include "timer.h"
+#include "plic.h"
+#include "uart.h"
 
 /* Linker-provided symbols */
 extern char __bss[], __bss_end[], __stack_top[];
-extern char _binary_shell_bin_start[], _binary_shell_bin_size[];
+extern char _binary_shell_stripped_elf_start[];
 
 /* SBI (Supervisor Binary Interface) functions */
 struct sbiret sbi_call(long arg0, long arg1, long arg2, long arg3, long arg4,
@@ -30,26 +34,29 @@ struct sbiret sbi_call(long arg0, long arg1, long arg2, long arg3, long arg4,
     return (struct sbiret){.error = a0, .value = a1};
 }
 
-void putchar(char ch) {
-    sbi_call(ch, 0, 0, 0, 0, 0, 0, 1 /* Console Putchar */);
-}
-
-long getchar(void) {
-    struct sbiret ret = sbi_call(0, 0, 0, 0, 0, 0, 0, 2 /* Console Getchar */);
-    return ret.error;
-}
-
 /* Kernel initialization and main loop */
 void kernel_main(void) {
     // Clear BSS section
     memset(__bss, 0, (size_t) __bss_end - (size_t) __bss);
 
+    console_init();
     printf("\n\n");
 
-    // Set up trap vector
+    // Use the vector unit if there is one. misa is M-mode only, so probe
+    // sstatus.VS instead: it is hardwired to zero without the V extension.
+    WRITE_CSR(sstatus, READ_CSR(sstatus) | SSTATUS_VS_INITIAL);
+    has_vector = (READ_CSR(sstatus) & SSTATUS_VS) != 0;
+    if (has_vector)
+        printf("vector extension enabled\n");
+
+    // Set up trap vector; sscratch is zero whenever we run in the kernel
     WRITE_CSR(stvec, (uint32_t) kernel_entry);
+    WRITE_CSR(sscratch, 0);
 
     // Initialize subsystems
+    memory_init();
+    plic_init();
+    uart_init();
     virtio_blk_init();
     fs_init();
 
@@ -62,15 +69,25 @@ void kernel_main(void) {
     read_write_disk(buf, 0, true);
 
     // Create idle process and shell process
-    idle_proc = create_process(NULL, 0);
+    idle_proc = create_process(NULL);
     idle_proc->pid = 0;
     current_proc = idle_proc;
 
-    create_process(_binary_shell_bin_start, (size_t) _binary_shell_bin_size);
+    create_process(_binary_shell_stripped_elf_start);
+
+    // Start preempting user processes
+    timer_init();
 
-    // Yield to first process
-    yield();
-    PANIC("switched to idle process");
+    // Idle loop: runs whenever no other process is runnable. wfi stalls the
+    // hart until an interrupt enabled in sie is pending; it wakes even with
+    // sstatus.SIE clear, so one arriving just before the wfi is not missed.
+    // Opening SIE then lets the handler run and wake sleepers.
+    while (1) {
+        yield();
+        __asm__ __volatile__("wfi");
+        WRITE_CSR(sstatus, READ_CSR(sstatus) | SSTATUS_SIE);
+        WRITE_CSR(sstatus, READ_CSR(sstatus) & ~SSTATUS_SIE);
+    }
 }
 
 /**
@@ -2,37 +2,106 @@
 #include "common.h"
 
 #define PAGE_SIZE       4096
-#define PROCS_MAX       8
+#define PROCS_MAX       256
 #define PROC_STACK_SIZE 8192
 
+#define TIMEBASE_FREQ   10000000    // QEMU virt: 10 MHz time counter
+#define TIME_SLICE_MS   10          // Preemption interval
+
 #define PROC_UNUSED     0
 #define PROC_RUNNABLE   1
 #define PROC_EXITED     2
+#define PROC_BLOCKED    3   // Asleep on a wait queue
+
+#define PRIO_LEVELS     32  // 0 is the highest priority
+#define PRIO_DEFAULT    16
 
 #define SATP_SV32   (1u << 31)
+#define SATP_ASID_SHIFT 22
+#define SATP_ASID_MASK  (0x1ffu << SATP_ASID_SHIFT)
 #define PAGE_V      (1 << 0)
 #define PAGE_R      (1 << 1)
 #define PAGE_W      (1 << 2)
 #define PAGE_X      (1 << 3)
 #define PAGE_U      (1 << 4)
+#define PAGE_G      (1 << 5)
+#define PAGE_COW    (1 << 8)    // Software bit: shared until written
+#define PAGE_LEAF   (PAGE_R | PAGE_W | PAGE_X)
+#define MEGAPAGE_SIZE   (4 * 1024 * 1024)
 
 #define USER_BASE 0x1000000
+#define USER_END  0x1800000
+#define SSTATUS_SIE  (1 << 1)
 #define SSTATUS_SPIE (1 << 5)
+#define SSTATUS_SPP (1 << 8)
+#define SSTATUS_VS  (3 << 9)
+#define SSTATUS_VS_INITIAL (1 << 9)
 #define SSTATUS_SUM (1 << 18)
 
-#define SCAUSE_ECALL 8
+#define SIE_STIE    (1 << 5)
+#define SIE_SEIE    (1 << 9)
+
+#define SCAUSE_INTERRUPT        (1u << 31)
+#define SCAUSE_S_TIMER          5   // With SCAUSE_INTERRUPT set
+#define SCAUSE_S_EXTERNAL       9   // With SCAUSE_INTERRUPT set
+#define SCAUSE_ECALL            8
+#define SCAUSE_INST_PAGE_FAULT  12
+#define SCAUSE_LOAD_PAGE_FAULT  13
+#define SCAUSE_STORE_PAGE_FAULT 15
+
+/* Writes out everything buffered for the console (console.c) */
+void console_flush(void);
 
 #define PANIC(fmt, ...)                                                         \
     do {                                                                        \
         printf("PANIC: %s:%d: " fmt "\n", __FILE__, __LINE__, ##__VA_ARGS__);   \
+        console_flush();                                                        \
         while (1) {}                                                            \
     } while (0)                                                                 \
 
+#define PROGRAM_SEGS_MAX 4
+
+/* A loadable segment of a user program */
+struct program_segment {
+    vaddr_t vaddr;
+    uint32_t memsz;
+    uint32_t filesz;
+    const uint8_t *data;    // File contents inside the embedded ELF image
+    uint32_t flags;         // PTE permissions (PAGE_R, PAGE_W, PAGE_X)
+    paddr_t *frames;        // Cached frame per file-backed page (0 = not loaded)
+};
+
+/* A user program loaded into memory, shared by every process running it */
+struct program {
+    const void *image;
+    vaddr_t entry;
+    int num_segs;
+    struct program_segment segs[PROGRAM_SEGS_MAX];
+    struct program *next;
+};
+
+/* Processes sleeping until an event, linked through process->wait_next */
+struct wait_queue {
+    struct process *head;
+};
+
+/* Runnable processes of one priority, linked through process->run_next */
+struct run_queue {
+    struct process *head;
+    struct process *tail;
+};
+
 struct process {
     int pid;
     int state;
+    int priority;               // 0 (highest) to PRIO_LEVELS - 1
     vaddr_t sp;
     uint32_t *page_table;
+    uint32_t asid;              // Address space ID tagged in satp
+    uint32_t asid_generation;   // Allocator generation the ASID belongs to
+    struct program *program;    // User image, paged in on first touch
+    struct process *wait_next;  // Next sleeper on the same wait queue
+    struct process *run_next;   // Next process on the same run queue
     uint8_t stack[PROC_STACK_SIZE];
 };
 
@@ -41,6 +110,10 @@ struct sbiret {
     long value;
 };
 
+/* Calls into the SBI firmware (kernel.c) */
+struct sbiret sbi_call(long arg0, long arg1, long arg2, long arg3, long arg4,
+                       long arg5, long fid, long eid);
+
 struct trap_frame {
     uint32_t  ra;
     uint32_t  gp;
@@ -87,6 +160,24 @@ struct trap_frame {
         __asm__ __volatile__("csrw " #reg ", %0" ::"r"(__tmp)); \
     } while (0)
 
+/* PLIC related defns (QEMU virt, hart 0 supervisor context) */
+#define PLIC_PADDR                  0x0c000000
+#define PLIC_SIZE                   0x400000
+#define PLIC_PRIORITY(irq)          (PLIC_PADDR + (irq) * 4)
+#define PLIC_SENABLE                (PLIC_PADDR + 0x2080)
+#define PLIC_STHRESHOLD             (PLIC_PADDR + 0x201000)
+#define PLIC_SCLAIM                 (PLIC_PADDR + 0x201004)
+#define VIRTIO_BLK_IRQ              1
+#define UART_IRQ                    10
+
+/* ns16550a UART related defns */
+#define UART_PADDR                  0x10000000
+#define UART_REG_RBR                0   // Receive buffer (read)
+#define UART_REG_IER                1   // Interrupt enable
+#define UART_REG_LSR                5   // Line status
+#define UART_IER_RX_AVAIL           1
+#define UART_LSR_DATA_READY         1
+
 /* Virtio related defns */
 #define SECTOR_SIZE                 512
 #define VIRTQ_ENTRY_NUM             16
@@ -95,6 +186,10 @@ struct trap_frame {
 #define VIRTIO_REG_MAGIC            0x00
 #define VIRTIO_REG_VERSION          0x04
 #define VIRTIO_REG_DEVICE_ID        0x08
+#define VIRTIO_REG_HOST_FEATURES    0x10
+#define VIRTIO_REG_HOST_FEATURES_SEL 0x14
+#define VIRTIO_REG_GUEST_FEATURES   0x20
+#define VIRTIO_REG_GUEST_FEATURES_SEL 0x24
 #define VIRTIO_REG_QUEUE_SEL        0x30
 #define VIRTIO_REG_QUEUE_NUM_MAX    0x34
 #define VIRTIO_REG_QUEUE_NUM        0x38
@@ -102,6 +197,8 @@ struct trap_frame {
 #define VIRTIO_REG_QUEUE_PFN        0x40
 #define VIRTIO_REG_QUEUE_READY      0x44
 #define VIRTIO_REG_QUEUE_NOTIFY     0x50
+#define VIRTIO_REG_INTERRUPT_STATUS 0x60
+#define VIRTIO_REG_INTERRUPT_ACK    0x64
 #define VIRTIO_REG_DEVICE_STATUS    0x70
 #define VIRTIO_REG_DEVICE_CONFIG    0x100
 #define VIRTIO_STATUS_ACK           1
@@ -110,9 +207,13 @@ struct trap_frame {
 #define VIRTIO_STATUS_FEAT_OK       8
 #define VIRTQ_DESC_F_NEXT           1
 #define VIRTQ_DESC_F_WRITE          2
-#define VIRTQ_AVAIL_F_NO_INTERRUPT  1
+#define VIRTQ_DESC_F_INDIRECT       4
+#define VIRTIO_RING_F_INDIRECT_DESC (1 << 28)
+#define VIRTIO_RING_F_EVENT_IDX     (1 << 29)
 #define VIRTIO_BLK_T_IN             0
 #define VIRTIO_BLK_T_OUT            1
+#define VIRTIO_BLK_S_IOERR          1
+#define VIRTIO_BLK_MAX_SECTORS      128 // Sectors per request (64KB)
 
 // Virtqueue Descriptor area entry
 struct virtq_desc {
@@ -127,6 +228,7 @@ struct virtq_avail {
     uint16_t flags;
     uint16_t index;
     uint16_t ring[VIRTQ_ENTRY_NUM];
+    uint16_t used_event;    // EVENT_IDX: interrupt once used index passes this
 } __attribute((packed));
 
 // Virtqueue Used Ring Entry
@@ -140,6 +242,7 @@ struct virtq_used {
     uint16_t flags;
     uint16_t index;
     struct virtq_used_elem ring[VIRTQ_ENTRY_NUM];
+    uint16_t avail_event;   // EVENT_IDX: notify once avail index passes this
 } __attribute__((packed));
 
 // Virtqueue
@@ -150,17 +253,27 @@ struct virtio_virtq {
     int queue_index;
     volatile uint16_t *used_index;
     uint16_t last_used_index;
+    uint16_t free_head;     // First free descriptor, chained through next
+    uint16_t num_free;
 } __attribute__((packed));
 
-// Virtio-blk request
+// Virtio-blk request header and status; the data has its own descriptor
 struct virtio_blk_req {
     uint32_t type;
     uint32_t reserved;
     uint64_t sector;
-    uint8_t data[512];
     uint8_t status;
 } __attribute__((packed));
 
+// Completion of a submitted virtio-blk request, owned by the submitter
+struct virtio_blk_completion {
+    volatile bool done;
+    uint8_t status;         // 0 on success
+    uint8_t *data;          // Bounce buffer, or NULL for direct DMA
+    void *buf;              // Where to copy data on reads, else NULL
+    uint32_t len;
+};
+
 #define FILES_MAX       2
 #define DISK_MAX_SIZE   align_up(sizeof(struct file) * FILES_MAX, SECTOR_SIZE)
 
@@ -185,6 +298,48 @@ struct tar_header {
     char data[];
 } __attribute__((packed));
 
+/* ELF related defns */
+#define ELF_MAGIC       0x464c457f  // "\x7fELF"
+#define ELFCLASS32      1
+#define ET_EXEC         2
+#define EM_RISCV        243
+#define PT_LOAD         1
+#define PF_X            (1 << 0)
+#define PF_W            (1 << 1)
+#define PF_R            (1 << 2)
+
+struct elf32_ehdr {
+    uint32_t magic;
+    uint8_t class;
+    uint8_t data;
+    uint8_t version;
+    uint8_t pad[9];
+    uint16_t type;
+    uint16_t machine;
+    uint32_t elf_version;
+    uint32_t entry;
+    uint32_t phoff;
+    uint32_t shoff;
+    uint32_t flags;
+    uint16_t ehsize;
+    uint16_t phentsize;
+    uint16_t phnum;
+    uint16_t shentsize;
+    uint16_t shnum;
+    uint16_t shstrndx;
+} __attribute__((packed));
+
+struct elf32_phdr {
+    uint32_t type;
+    uint32_t offset;
+    uint32_t vaddr;
+    uint32_t paddr;
+    uint32_t filesz;
+    uint32_t memsz;
+    uint32_t flags;
+    uint32_t align;
+} __attribute__((packed));
+
 struct file {
     bool in_use;
     char name[100];
@@ -1,19 +1,247 @@
 #include "memory.h"
 
-extern char __free_ram[], __free_ram_end[];
+extern char __kernel_base[], __free_ram[], __free_ram_end[];
+
+/* Largest buddy block: 2^MAX_ORDER pages (4 MB, one Sv32 megapage) */
+#define MAX_ORDER 10
+
+/**
+ * Per-page metadata. Only the entry for the first page of a block is
+ * meaningful: it records the block's order and whether it is on a free list.
+ */
+struct page {
+    uint8_t order;
+    uint8_t is_free;
+    uint16_t refcount;  // Page tables sharing the block (copy-on-write)
+};
+
+/* Free blocks are linked through their own (identity-mapped) memory */
+struct free_block {
+    struct free_block *next;
+    struct free_block *prev;
+};
+
+static struct page *pages;
+static paddr_t ram_base;
+static uint32_t ram_pages;
+static struct free_block free_lists[MAX_ORDER + 1];
+
+/* Level-1 table holding the kernel mappings shared by every process */
+static uint32_t *kernel_table1;
+
+uint32_t num_asids;
+
+/**
+ * A slab is one page carved into equal objects of a single size class.
+ * This header sits at the start of the page; free objects are linked
+ * through their own first word.
+ */
+struct slab {
+    struct kmem_cache *cache;
+    struct slab *next;
+    struct slab *prev;
+    void *free;
+    uint32_t in_use;
+};
+
+struct kmem_cache {
+    size_t size;
+    struct slab *partial;   // Slabs with at least one free object
+};
+
+#define SLAB_OBJ_OFFSET align_up(sizeof(struct slab), 16)
+#define KMALLOC_MAX     1024
+
+static struct kmem_cache kmalloc_caches[] = {
+    {.size = 16}, {.size = 32}, {.size = 64}, {.size = 128},
+    {.size = 256}, {.size = 512}, {.size = KMALLOC_MAX},
+};
+
+/**
+ * Returns the physical page number of a managed page. Blocks are aligned
+ * to their size in physical memory, so a 4 MB block can back a megapage.
+ */
+static uint32_t page_to_pfn(uint32_t index) {
+    return ram_base / PAGE_SIZE + index;
+}
+
+static struct free_block *page_to_block(uint32_t index) {
+    return (struct free_block *) (ram_base + index * PAGE_SIZE);
+}
+
+static uint32_t block_to_page(struct free_block *block) {
+    return ((paddr_t) block - ram_base) / PAGE_SIZE;
+}
+
+static void free_list_push(uint32_t index, int order) {
+    struct free_block *head = &free_lists[order];
+    struct free_block *block = page_to_block(index);
+    block->next = head->next;
+    block->prev = head;
+    head->next->prev = block;
+    head->next = block;
+
+    pages[index].order = order;
+    pages[index].is_free = true;
+}
+
+static void free_list_remove(uint32_t index) {
+    struct free_block *block = page_to_block(index);
+    block->prev->next = block->next;
+    block->next->prev = block->prev;
+    pages[index].is_free = false;
+}
+
+/**
+ * Returns the smallest order whose block size holds n pages.
+ */
+static int pages_to_order(uint32_t n) {
+    int order = 0;
+    while ((1u << order) < n)
+        order++;
+
+    if (order > MAX_ORDER)
+        PANIC("allocation too large: %d pages", n);
+    return order;
+}
+
+void memory_init(void) {
+    paddr_t start = (paddr_t) __free_ram;
+    paddr_t end = (paddr_t) __free_ram_end;
+
+    // Carve the page metadata array out of the start of free RAM
+    uint32_t total_pages = (end - start) / PAGE_SIZE;
+    pages = (struct page *) start;
+    ram_base = start + align_up(total_pages * sizeof(struct page), PAGE_SIZE);
+    ram_pages = (end - ram_base) / PAGE_SIZE;
+    memset(pages, 0, ram_pages * sizeof(struct page));
+
+    for (int order = 0; order <= MAX_ORDER; order++) {
+        free_lists[order].next = &free_lists[order];
+        free_lists[order].prev = &free_lists[order];
+    }
+
+    // Hand the remaining pages to the free lists as the largest physically
+    // aligned blocks that fit
+    uint32_t index = 0;
+    while (index < ram_pages) {
+        int order = MAX_ORDER;
+        while ((page_to_pfn(index) & ((1u << order) - 1))
+               || index + (1u << order) > ram_pages)
+            order--;
+
+        free_list_push(index, order);
+        index += 1u << order;
+    }
+
+    // Build the kernel mappings once; every process root table points at
+    // the same level-0 tables and megapages. They are global so their TLB
+    // entries survive ASID-scoped flushes.
+    kernel_table1 = (uint32_t *) alloc_pages(1);
+    map_range(kernel_table1, (vaddr_t) __kernel_base, (paddr_t) __kernel_base,
+              (paddr_t) __free_ram_end - (paddr_t) __kernel_base,
+              PAGE_R | PAGE_W | PAGE_X | PAGE_G);
+
+    // Map device registers: virtio-blk, the UART and the PLIC
+    map_page(kernel_table1, VIRTIO_BLK_PADDR, VIRTIO_BLK_PADDR,
+             PAGE_R | PAGE_W | PAGE_G);
+    map_page(kernel_table1, UART_PADDR, UART_PADDR, PAGE_R | PAGE_W | PAGE_G);
+    map_range(kernel_table1, PLIC_PADDR, PLIC_PADDR, PLIC_SIZE,
+              PAGE_R | PAGE_W | PAGE_G);
+
+    // Switch the kernel onto its own table. Writing all ones to the ASID
+    // field and reading it back reveals how many ASID bits are implemented.
+    uint32_t kernel_satp = SATP_SV32 | ((paddr_t) kernel_table1 / PAGE_SIZE);
+    __asm__ __volatile__("sfence.vma");
+    WRITE_CSR(satp, kernel_satp | SATP_ASID_MASK);
+    num_asids = ((READ_CSR(satp) & SATP_ASID_MASK) >> SATP_ASID_SHIFT) + 1;
+    WRITE_CSR(satp, kernel_satp);
+    __asm__ __volatile__("sfence.vma");
+    printf("memory: %d ASIDs available\n", num_asids);
+}
 
 paddr_t alloc_pages(uint32_t n) {
-    static paddr_t next_paddr = (paddr_t) __free_ram;
-    paddr_t paddr = next_paddr;
-    next_paddr += n * PAGE_SIZE;
+    int order = pages_to_order(n);
 
-    if (next_paddr > (paddr_t) __free_ram_end)
+    // Find the smallest non-empty free list that can satisfy the request
+    int current = order;
+    while (current <= MAX_ORDER && free_lists[current].next == &free_lists[current])
+        current++;
+
+    if (current > MAX_ORDER)
         PANIC("out of memory");
 
+    uint32_t index = block_to_page(free_lists[current].next);
+    free_list_remove(index);
+
+    // Split the block, returning the upper halves to the free lists
+    while (current > order) {
+        current--;
+        free_list_push(index + (1u << current), current);
+    }
+
+    pages[index].order = order;
+    pages[index].refcount = 1;
+
+    paddr_t paddr = ram_base + index * PAGE_SIZE;
     memset((void *) paddr, 0, n * PAGE_SIZE);
     return paddr;
 }
 
+void free_pages(paddr_t paddr, uint32_t n) {
+    if (!is_aligned(paddr, PAGE_SIZE))
+        PANIC("unaligned paddr %x", paddr);
+
+    if (paddr < ram_base || paddr >= ram_base + ram_pages * PAGE_SIZE)
+        PANIC("freeing non-heap paddr %x", paddr);
+
+    uint32_t index = (paddr - ram_base) / PAGE_SIZE;
+    int order = pages_to_order(n);
+    if (pages[index].is_free || pages[index].order != order)
+        PANIC("bad free of paddr %x (%d pages)", paddr, n);
+
+    // Coalesce with the buddy block for as long as it is free and whole
+    while (order < MAX_ORDER) {
+        uint32_t buddy_pfn = page_to_pfn(index) ^ (1u << order);
+        if (buddy_pfn < page_to_pfn(0))
+            break;
+
+        uint32_t buddy = buddy_pfn - page_to_pfn(0);
+        if (buddy + (1u << order) > ram_pages)
+            break;
+        if (!pages[buddy].is_free || pages[buddy].order != order)
+            break;
+
+        free_list_remove(buddy);
+        if (buddy < index)
+            index = buddy;
+        order++;
+    }
+
+    free_list_push(index, order);
+}
+
+static struct page *paddr_to_page(paddr_t paddr) {
+    if (paddr < ram_base || paddr >= ram_base + ram_pages * PAGE_SIZE)
+        PANIC("paddr %x is not a heap page", paddr);
+
+    return &pages[(paddr - ram_base) / PAGE_SIZE];
+}
+
+void page_get(paddr_t paddr) {
+    paddr_to_page(paddr)->refcount++;
+}
+
+void page_put(paddr_t paddr) {
+    struct page *page = paddr_to_page(paddr);
+    if (--page->refcount == 0)
+        free_pages(paddr, 1u << page->order);
+}
+
+uint32_t page_refcount(paddr_t paddr) {
+    return paddr_to_page(paddr)->refcount;
+}
+
 void map_page(uint32_t *table1, uint32_t vaddr, paddr_t paddr, uint32_t flags) {
     if (!is_aligned(vaddr, PAGE_SIZE))
         PANIC("unaligned vaddr %x", vaddr);
@@ -23,6 +251,9 @@ void map_page(uint32_t *table1, uint32_t vaddr, paddr_t paddr, uint32_t flags) {
 
     // Extract VPN[1] (bits 31:22)
     uint32_t vpn1 = (vaddr >> 22) & 0x3ff;
+    if (table1[vpn1] & PAGE_LEAF)
+        PANIC("vaddr %x is already covered by a megapage", vaddr);
+
     if ((table1[vpn1] & PAGE_V) == 0) {
         // Allocate level-0 page table if it doesn't exist
         uint32_t pt_paddr = alloc_pages(1);
@@ -33,4 +264,202 @@ void map_page(uint32_t *table1, uint32_t vaddr, paddr_t paddr, uint32_t flags) {
     uint32_t vpn0 = (vaddr >> 12) & 0x3ff;
     uint32_t *table0 = (uint32_t *) ((table1[vpn1] >> 10) * PAGE_SIZE);
     table0[vpn0] = ((paddr / PAGE_SIZE) << 10) | flags | PAGE_V;
-}
\ No newline at end of file
+}
+
+void map_megapage(uint32_t *table1, uint32_t vaddr, paddr_t paddr, uint32_t flags) {
+    if (!is_aligned(vaddr, MEGAPAGE_SIZE))
+        PANIC("unaligned megapage vaddr %x", vaddr);
+
+    if (!is_aligned(paddr, MEGAPAGE_SIZE))
+        PANIC("unaligned megapage paddr %x", paddr);
+
+    // A leaf PTE in the level-1 table maps the whole 4 MB range
+    uint32_t vpn1 = (vaddr >> 22) & 0x3ff;
+    if (table1[vpn1] & PAGE_V)
+        PANIC("vaddr %x is already mapped", vaddr);
+
+    table1[vpn1] = ((paddr / PAGE_SIZE) << 10) | flags | PAGE_V;
+}
+
+void map_range(uint32_t *table1, uint32_t vaddr, paddr_t paddr, uint32_t size,
+               uint32_t flags) {
+    uint32_t off = 0;
+    while (off < size) {
+        // Use a megapage whenever both addresses are 4 MB aligned and the
+        // rest of the range covers it
+        if (is_aligned(vaddr + off, MEGAPAGE_SIZE)
+            && is_aligned(paddr + off, MEGAPAGE_SIZE)
+            && size - off >= MEGAPAGE_SIZE) {
+            map_megapage(table1, vaddr + off, paddr + off, flags);
+            off += MEGAPAGE_SIZE;
+        } else {
+            map_page(table1, vaddr + off, paddr + off, flags);
+            off += PAGE_SIZE;
+        }
+    }
+}
+
+uint32_t *lookup_pte(uint32_t *table1, uint32_t vaddr) {
+    uint32_t vpn1 = (vaddr >> 22) & 0x3ff;
+    if ((table1[vpn1] & PAGE_V) == 0)
+        return NULL;
+
+    // Megapage leaf in the level-1 table
+    if (table1[vpn1] & PAGE_LEAF)
+        return &table1[vpn1];
+
+    uint32_t vpn0 = (vaddr >> 12) & 0x3ff;
+    uint32_t *table0 = (uint32_t *) ((table1[vpn1] >> 10) * PAGE_SIZE);
+    return &table0[vpn0];
+}
+
+uint32_t *create_page_table(void) {
+    uint32_t *table1 = (uint32_t *) alloc_pages(1);
+    memcpy(table1, kernel_table1, PAGE_SIZE);
+    return table1;
+}
+
+uint32_t *fork_page_table(uint32_t *table1) {
+    uint32_t *child = create_page_table();
+
+    for (int vpn1 = 0; vpn1 < 1024; vpn1++) {
+        if ((table1[vpn1] & PAGE_V) == 0 || table1[vpn1] == kernel_table1[vpn1])
+            continue;
+
+        // Writable frames lose PAGE_W in both tables and become PAGE_COW
+        if (table1[vpn1] & PAGE_LEAF) {
+            if (table1[vpn1] & PAGE_W)
+                table1[vpn1] = (table1[vpn1] & ~PAGE_W) | PAGE_COW;
+            child[vpn1] = table1[vpn1];
+            page_get((table1[vpn1] >> 10) * PAGE_SIZE);
+            continue;
+        }
+
+        uint32_t *table0 = (uint32_t *) ((table1[vpn1] >> 10) * PAGE_SIZE);
+        for (int vpn0 = 0; vpn0 < 1024; vpn0++) {
+            uint32_t pte = table0[vpn0];
+            if ((pte & PAGE_V) == 0 || (pte & PAGE_U) == 0)
+                continue;
+
+            if (pte & PAGE_W)
+                table0[vpn0] = pte = (pte & ~PAGE_W) | PAGE_COW;
+
+            paddr_t paddr = (pte >> 10) * PAGE_SIZE;
+            page_get(paddr);
+            map_page(child, (vpn1 << 22) | (vpn0 << 12), paddr, pte & 0x3ff & ~PAGE_V);
+        }
+    }
+
+    return child;
+}
+
+void free_page_table(uint32_t *table1) {
+    for (int vpn1 = 0; vpn1 < 1024; vpn1++) {
+        // Skip empty entries and the shared kernel level-0 tables
+        if ((table1[vpn1] & PAGE_V) == 0 || table1[vpn1] == kernel_table1[vpn1])
+            continue;
+
+        // User megapages are backed by a single 4 MB block
+        if (table1[vpn1] & PAGE_LEAF) {
+            if (table1[vpn1] & PAGE_U)
+                page_put((table1[vpn1] >> 10) * PAGE_SIZE);
+            continue;
+        }
+
+        uint32_t *table0 = (uint32_t *) ((table1[vpn1] >> 10) * PAGE_SIZE);
+        for (int vpn0 = 0; vpn0 < 1024; vpn0++) {
+            uint32_t pte = table0[vpn0];
+            if ((pte & PAGE_V) && (pte & PAGE_U))
+                page_put((pte >> 10) * PAGE_SIZE);
+        }
+
+        free_pages((paddr_t) table0, 1);
+    }
+
+    free_pages((paddr_t) table1, 1);
+}
+
+static struct slab *slab_create(struct kmem_cache *cache) {
+    struct slab *slab = (struct slab *) alloc_pages(1);
+    slab->cache = cache;
+
+    // Thread every object onto the free list
+    uint8_t *obj = (uint8_t *) slab + SLAB_OBJ_OFFSET;
+    uint8_t *end = (uint8_t *) slab + PAGE_SIZE;
+    for (; obj + cache->size <= end; obj += cache->size) {
+        *(void **) obj = slab->free;
+        slab->free = obj;
+    }
+
+    return slab;
+}
+
+static void slab_list_add(struct kmem_cache *cache, struct slab *slab) {
+    slab->prev = NULL;
+    slab->next = cache->partial;
+    if (cache->partial)
+        cache->partial->prev = slab;
+    cache->partial = slab;
+}
+
+static void slab_list_remove(struct kmem_cache *cache, struct slab *slab) {
+    if (slab->prev)
+        slab->prev->next = slab->next;
+    else
+        cache->partial = slab->next;
+
+    if (slab->next)
+        slab->next->prev = slab->prev;
+}
+
+void *kmalloc(size_t size) {
+    // Requests larger than the biggest size class get whole pages, which
+    // kfree() recognizes by their page alignment
+    if (size > KMALLOC_MAX)
+        return (void *) alloc_pages(align_up(size, PAGE_SIZE) / PAGE_SIZE);
+
+    struct kmem_cache *cache = kmalloc_caches;
+    while (cache->size < size)
+        cache++;
+
+    if (!cache->partial)
+        slab_list_add(cache, slab_create(cache));
+
+    struct slab *slab = cache->partial;
+    void *obj = slab->free;
+    slab->free = *(void **) obj;
+    slab->in_use++;
+    if (!slab->free)
+        slab_list_remove(cache, slab);
+
+    memset(obj, 0, cache->size);
+    return obj;
+}
+
+void kfree(void *ptr) {
+    if (!ptr)
+        return;
+
+    if (is_aligned((paddr_t) ptr, PAGE_SIZE)) {
+        uint32_t index = ((paddr_t) ptr - ram_base) / PAGE_SIZE;
+        free_pages((paddr_t) ptr, 1u << pages[index].order);
+        return;
+    }
+
+    struct slab *slab = (struct slab *) align_down((paddr_t) ptr, PAGE_SIZE);
+    struct kmem_cache *cache = slab->cache;
+
+    // A full slab is off the partial list until it gets a free object back
+    if (!slab->free)
+        slab_list_add(cache, slab);
+
+    *(void **) ptr = slab->free;
+    slab->free = ptr;
+    slab->in_use--;
+
+    // Return empty slabs to the page allocator
+    if (slab->in_use == 0) {
+        slab_list_remove(cache, slab);
+        free_pages((paddr_t) slab, 1);
+    }
+}
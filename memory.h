@@ -2,12 +2,50 @@
 #include "common.h"
 #include "kernel.h"
 
+/* Number of address space IDs supported by the hart (1 if none) */
+extern uint32_t num_asids;
+
+/**
+ * Initializes the buddy page allocator over the __free_ram region,
+ * builds the kernel mappings shared by all page tables, switches the
+ * kernel onto them and probes the number of ASIDs.
+ * Must be called before the first alloc_pages().
+ */
+void memory_init(void);
+
 /**
  * Allocates n contiguous physical pages and returns the physical address.
- * Pages are zeroed before returning.
+ * The request is rounded up to a power-of-two block. Pages are zeroed
+ * before returning.
  */
 paddr_t alloc_pages(uint32_t n);
 
+/**
+ * Returns pages obtained from alloc_pages() to the allocator, merging the
+ * block with its free buddies.
+ *
+ * @param paddr - Physical address returned by alloc_pages()
+ * @param n - Number of pages passed to alloc_pages()
+ */
+void free_pages(paddr_t paddr, uint32_t n);
+
+/**
+ * Takes an extra reference on a block from alloc_pages(), e.g. when
+ * another page table starts sharing it.
+ */
+void page_get(paddr_t paddr);
+
+/**
+ * Drops a reference on a block from alloc_pages(), freeing it when the
+ * last reference goes away.
+ */
+void page_put(paddr_t paddr);
+
+/**
+ * Returns the number of references to a block from alloc_pages().
+ */
+uint32_t page_refcount(paddr_t paddr);
+
 /**
  * Maps a virtual address to a physical address in the given page table.
  * Creates intermediate page table entries as needed.
@@ -18,3 +56,83 @@ paddr_t alloc_pages(uint32_t n);
  * @param flags - Page table entry flags (PAGE_R, PAGE_W, PAGE_X, PAGE_U)
  */
 void map_page(uint32_t *table1, uint32_t vaddr, paddr_t paddr, uint32_t flags);
+
+/**
+ * Maps a 4 MB megapage with a leaf PTE directly in the level-1 table.
+ *
+ * @param table1 - Pointer to the level-1 page table
+ * @param vaddr - Virtual address to map (must be 4 MB aligned)
+ * @param paddr - Physical address to map to (must be 4 MB aligned)
+ * @param flags - Page table entry flags (PAGE_R, PAGE_W, PAGE_X, PAGE_U)
+ */
+void map_megapage(uint32_t *table1, uint32_t vaddr, paddr_t paddr, uint32_t flags);
+
+/**
+ * Maps a physically contiguous range, using megapages for every 4 MB
+ * aligned chunk and 4 KB pages for the unaligned head and tail.
+ *
+ * @param table1 - Pointer to the level-1 page table
+ * @param vaddr - First virtual address to map (must be page-aligned)
+ * @param paddr - First physical address to map to (must be page-aligned)
+ * @param size - Size of the range in bytes (must be page-aligned)
+ * @param flags - Page table entry flags (PAGE_R, PAGE_W, PAGE_X, PAGE_U)
+ */
+void map_range(uint32_t *table1, uint32_t vaddr, paddr_t paddr, uint32_t size,
+               uint32_t flags);
+
+/**
+ * Finds the leaf PTE slot that translates vaddr: a level-0 entry, or the
+ * level-1 entry itself for a megapage.
+ *
+ * @param table1 - Pointer to the level-1 page table
+ * @param vaddr - Virtual address to look up
+ * @return Pointer to the PTE (which may be invalid), or NULL if there is
+ *         no level-0 table for vaddr
+ */
+uint32_t *lookup_pte(uint32_t *table1, uint32_t vaddr);
+
+/**
+ * Allocates a new level-1 page table with the kernel and device mappings
+ * already in place. The kernel level-0 tables are shared, not copied.
+ *
+ * @return Pointer to the new level-1 page table
+ */
+uint32_t *create_page_table(void);
+
+/**
+ * Duplicates a page table for fork(). User frames are shared rather than
+ * copied: writable ones are marked PAGE_COW and read-only in both tables,
+ * and every shared frame gains a reference. The caller must flush the
+ * TLB for the original table.
+ *
+ * @param table1 - Level-1 page table to duplicate
+ * @return Pointer to the new level-1 page table
+ */
+uint32_t *fork_page_table(uint32_t *table1);
+
+/**
+ * Frees a page table returned by create_page_table(): drops a reference
+ * on every user frame (PAGE_U leaf, including 4 MB megapages allocated as
+ * one block), frees every private level-0 table, and the level-1 table
+ * itself.
+ * The shared kernel level-0 tables are left alone.
+ *
+ * @param table1 - Pointer to the level-1 page table
+ */
+void free_page_table(uint32_t *table1);
+
+/**
+ * Allocates a zeroed kernel object of the given size. Small requests are
+ * served from per-size-class slabs; larger ones get whole pages.
+ *
+ * @param size - Size of the object in bytes
+ * @return Pointer to the object (identity-mapped, physically contiguous)
+ */
+void *kmalloc(size_t size);
+
+/**
+ * Frees an object returned by kmalloc(). Passing NULL does nothing.
+ *
+ * @param ptr - Pointer returned by kmalloc()
+ */
+void kfree(void *ptr);
@@ -0,0 +1,20 @@
+#include "plic.h"
+
+void plic_init(void) {
+    // Accept every priority above zero
+    *((volatile uint32_t *) PLIC_STHRESHOLD) = 0;
+    WRITE_CSR(sie, READ_CSR(sie) | SIE_SEIE);
+}
+
+void plic_enable(uint32_t irq) {
+    *((volatile uint32_t *) PLIC_PRIORITY(irq)) = 1;
+    *((volatile uint32_t *) PLIC_SENABLE) |= 1u << irq;
+}
+
+uint32_t plic_claim(void) {
+    return *((volatile uint32_t *) PLIC_SCLAIM);
+}
+
+void plic_complete(uint32_t irq) {
+    *((volatile uint32_t *) PLIC_SCLAIM) = irq;
+}
@@ -0,0 +1,30 @@
+#pragma once
+#include "common.h"
+#include "kernel.h"
+
+/**
+ * Sets up the PLIC for supervisor mode on hart 0 and enables external
+ * interrupts in sie. Individual sources are turned on with plic_enable().
+ */
+void plic_init(void);
+
+/**
+ * Routes an interrupt source to supervisor mode on hart 0.
+ *
+ * @param irq - Interrupt source number
+ */
+void plic_enable(uint32_t irq);
+
+/**
+ * Claims the highest-priority pending interrupt.
+ *
+ * @return The interrupt source number, or 0 if none is pending
+ */
+uint32_t plic_claim(void);
+
+/**
+ * Signals that a claimed interrupt has been handled.
+ *
+ * @param irq - Interrupt source number returned by plic_claim()
+ */
+void plic_complete(uint32_t irq);
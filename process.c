@@ -1,12 +1,35 @@
 #include "process.h"
 #include "memory.h"
-
-extern char __kernel_base[];
+#include "timer.h"
 
 /* Global process state */
 struct process procs[PROCS_MAX];
 struct process *current_proc;
 struct process *idle_proc;
+bool need_resched;
+
+/* Programs loaded so far, looked up by image */
+static struct program *programs;
+
+/* ASID allocator: ASIDs are handed out in order and recycled all at once,
+ * by starting a new generation and flushing the whole TLB, when they run out.
+ * ASID 0 is left to the kernel's own table. Without ASID support
+ * (num_asids == 1) every switch starts a new generation and flushes. */
+static uint32_t asid_generation = 1;
+static uint32_t next_asid = 1;
+
+/* Scheduler: one FIFO run queue per priority. Bit p of ready_bitmap is set
+ * while run_queues[p] is non-empty, so picking the next process costs the
+ * same however many processes exist. The running process and the idle
+ * process are never on a run queue. */
+static struct run_queue run_queues[PRIO_LEVELS];
+static uint32_t ready_bitmap;
+
+/* Process slots: reaped slots are kept on a free list linked through
+ * run_next, and slots never used yet are handed out in order, so creating
+ * a process does not scan procs[] either. */
+static struct process *free_procs;
+static int procs_used;
 
 /**
  * Context switch assembly routine.
@@ -56,38 +79,111 @@ void switch_context(uint32_t *prev_sp, uint32_t *next_sp) {
 
 /**
  * Entry point for transitioning from kernel mode to user mode.
- * Sets up sepc (user program counter) and sstatus (status register),
- * then executes sret to jump to user mode.
+ * Sets up sepc (user program counter, the program entry point left in s0),
+ * sstatus (status register) and sscratch (top of this process's kernel
+ * stack, where sp is right now), then executes sret to jump to user mode.
  */
 __attribute__((naked))
 void user_entry(void) {
     __asm__ __volatile__(
-        "csrw sepc, %[sepc]\n"
+        "csrw sepc, s0\n"
         "csrw sstatus, %[sstatus]\n"
+        "csrw sscratch, sp\n"
         "sret\n"
         :
-        : [sepc] "r" (USER_BASE),
-          [sstatus] "r" (SSTATUS_SPIE | SSTATUS_SUM)
+        : [sstatus] "r" (SSTATUS_SPIE | SSTATUS_SUM)
     );
 }
 
-struct process *create_process(const void *image, size_t image_size) {
-    // Find an unused process slot
-    struct process *proc = NULL;
-    int i;
-    for (i = 0; i < PROCS_MAX; i++) {
-        if (procs[i].state == PROC_UNUSED) {
-            proc = &procs[i];
-            break;
-        }
+/**
+ * Entry point for a child created by fork_process().
+ * Its kernel stack holds a copy of the parent's trap frame; s0 holds the
+ * user program counter to resume at. Jumps into the tail of kernel_entry,
+ * which restores the registers and returns to user mode.
+ */
+__attribute__((naked))
+void fork_entry(void) {
+    __asm__ __volatile__(
+        "csrw sepc, s0\n"
+        "csrw sstatus, %[sstatus]\n"
+        "j trap_return\n"
+        :
+        : [sstatus] "r" (SSTATUS_SPIE | SSTATUS_SUM)
+    );
+}
+
+/**
+ * Appends a runnable process to the run queue of its priority.
+ */
+static void enqueue(struct process *proc) {
+    struct run_queue *queue = &run_queues[proc->priority];
+    proc->run_next = NULL;
+    if (queue->tail)
+        queue->tail->run_next = proc;
+    else
+        queue->head = proc;
+    queue->tail = proc;
+    ready_bitmap |= 1u << proc->priority;
+}
+
+/**
+ * Puts a runnable process at the front of the run queue of its priority,
+ * so it runs before the processes already waiting there.
+ */
+static void enqueue_front(struct process *proc) {
+    struct run_queue *queue = &run_queues[proc->priority];
+    proc->run_next = queue->head;
+    if (!queue->tail)
+        queue->tail = proc;
+    queue->head = proc;
+    ready_bitmap |= 1u << proc->priority;
+}
+
+/**
+ * Removes and returns the first process of the highest-priority non-empty
+ * run queue, or NULL if nothing is runnable.
+ */
+static struct process *dequeue(void) {
+    if (!ready_bitmap)
+        return NULL;
+
+    int priority = __builtin_ctz(ready_bitmap);
+    struct run_queue *queue = &run_queues[priority];
+    struct process *proc = queue->head;
+    queue->head = proc->run_next;
+    if (!queue->head) {
+        queue->tail = NULL;
+        ready_bitmap &= ~(1u << priority);
     }
+    proc->run_next = NULL;
+    return proc;
+}
 
-    if (!proc)
-        PANIC("no free process slots");
+/**
+ * Takes an unused process slot and assigns its pid.
+ * Returns NULL if every slot is in use.
+ */
+static struct process *alloc_process(void) {
+    struct process *proc = free_procs;
+    if (proc)
+        free_procs = proc->run_next;
+    else if (procs_used < PROCS_MAX)
+        proc = &procs[procs_used++];
+    else
+        return NULL;
 
-    // Initialize process stack for context switching
-    // Stack layout: s0-s11 saved by switch_context, ra points to user_entry
-    uint32_t *sp = (uint32_t *) &proc->stack[sizeof(proc->stack)];
+    proc->run_next = NULL;
+    proc->pid = proc - procs + 1;
+    return proc;
+}
+
+/**
+ * Pushes the registers switch_context() restores, so that the first switch
+ * into the process returns to entry with s0 set.
+ * Returns the resulting stack pointer.
+ */
+static uint32_t init_context(uint32_t *sp, void (*entry)(void), uint32_t s0) {
+    // Stack layout: s0-s11 saved by switch_context, ra points to entry
     *--sp = 0;      // s11
     *--sp = 0;      // s10
     *--sp = 0;      // s9
@@ -99,65 +195,386 @@ struct process *create_process(const void *image, size_t image_size) {
     *--sp = 0;      // s3
     *--sp = 0;      // s2
     *--sp = 0;      // s1
-    *--sp = 0;      // s0
-    *--sp = (uint32_t) user_entry;  // ra - will jump to user_entry on first context switch
+    *--sp = s0;     // s0
+    *--sp = (uint32_t) entry;   // ra - will jump to entry on first context switch
+    return (uint32_t) sp;
+}
+
+/**
+ * Parses the program headers of an ELF image into a program. Only PT_LOAD
+ * segments are kept; nothing is copied until the pages are touched.
+ */
+static struct program *load_program(const void *image) {
+    const struct elf32_ehdr *ehdr = image;
+    if (ehdr->magic != ELF_MAGIC || ehdr->class != ELFCLASS32
+        || ehdr->type != ET_EXEC || ehdr->machine != EM_RISCV)
+        PANIC("invalid ELF image");
+
+    struct program *prog = kmalloc(sizeof(*prog));
+    prog->image = image;
+    prog->entry = ehdr->entry;
 
-    // Create page table and map kernel pages
-    uint32_t *page_table = (uint32_t *) alloc_pages(1);
-    for (paddr_t paddr = (paddr_t) __kernel_base;
-         paddr < (paddr_t) __kernel_base + 0x200000; paddr += PAGE_SIZE)
-        map_page(page_table, paddr, paddr, PAGE_R | PAGE_W | PAGE_X);
+    for (int i = 0; i < ehdr->phnum; i++) {
+        const struct elf32_phdr *phdr =
+            image + ehdr->phoff + i * ehdr->phentsize;
+        if (phdr->type != PT_LOAD || phdr->memsz == 0)
+            continue;
 
-    // Map virtio-blk device registers
-    map_page(page_table, VIRTIO_BLK_PADDR, VIRTIO_BLK_PADDR, PAGE_R | PAGE_W);
+        if (prog->num_segs == PROGRAM_SEGS_MAX)
+            PANIC("too many ELF segments");
 
-    // Map user program pages
-    for (uint32_t off = 0; off < image_size; off += PAGE_SIZE) {
-        paddr_t page = alloc_pages(1);
+        if (phdr->vaddr < USER_BASE || phdr->vaddr + phdr->memsz > USER_END
+            || phdr->filesz > phdr->memsz)
+            PANIC("invalid ELF segment vaddr=%x memsz=%x", phdr->vaddr, phdr->memsz);
 
-        size_t remaining = image_size - off;
-        size_t copy_size = PAGE_SIZE <= remaining ? PAGE_SIZE : remaining;
+        struct program_segment *seg = &prog->segs[prog->num_segs++];
+        seg->vaddr = phdr->vaddr;
+        seg->memsz = phdr->memsz;
+        seg->filesz = phdr->filesz;
+        seg->data = image + phdr->offset;
+        seg->flags = ((phdr->flags & PF_R) ? PAGE_R : 0)
+                   | ((phdr->flags & PF_W) ? PAGE_W : 0)
+                   | ((phdr->flags & PF_X) ? PAGE_X : 0);
 
-        memcpy((void *) page, image + off, copy_size);
-        map_page(page_table, USER_BASE + off, page,
-                 PAGE_U | PAGE_R | PAGE_W | PAGE_X);
+        uint32_t num_pages = (align_up(seg->vaddr + seg->memsz, PAGE_SIZE)
+                              - align_down(seg->vaddr, PAGE_SIZE)) / PAGE_SIZE;
+        seg->frames = kmalloc(num_pages * sizeof(paddr_t));
     }
 
+    return prog;
+}
+
+/**
+ * Returns the program for an ELF image, loading its program headers the
+ * first time the image is run.
+ */
+static struct program *get_program(const void *image) {
+    for (struct program *prog = programs; prog; prog = prog->next) {
+        if (prog->image == image)
+            return prog;
+    }
+
+    struct program *prog = load_program(image);
+    prog->next = programs;
+    programs = prog;
+    return prog;
+}
+
+struct process *create_process(const void *image) {
+    struct process *proc = alloc_process();
+    if (!proc)
+        PANIC("no free process slots");
+
+    struct program *prog = image ? get_program(image) : NULL;
+
+    // Initialize process stack for context switching
+    proc->sp = init_context((uint32_t *) &proc->stack[sizeof(proc->stack)],
+                            user_entry, prog ? prog->entry : 0);
+
+    // Create page table with the shared kernel and device mappings
+    uint32_t *page_table = create_page_table();
+
     // Initialize process control block
-    proc->pid = i + 1;
     proc->state = PROC_RUNNABLE;
-    proc->sp = (uint32_t) sp;
+    proc->priority = PRIO_DEFAULT;
     proc->page_table = page_table;
+    proc->asid_generation = 0;  // Assigned on first switch
+    proc->program = prog;       // User pages are filled in on first touch
+
+    // The idle process runs only when every run queue is empty
+    if (image)
+        enqueue(proc);
     return proc;
 }
 
-void yield(void) {
-    // Round-robin scheduler: find next runnable process
-    struct process *next = idle_proc;
-    for (int i = 0; i < PROCS_MAX; i++) {
-        struct process *proc = &procs[(current_proc->pid + i) % PROCS_MAX];
-        if (proc->state == PROC_RUNNABLE && proc->pid > 0) {
-            next = proc;
-            break;
+struct process *fork_process(struct trap_frame *f, uint32_t user_pc) {
+    struct process *parent = current_proc;
+    struct process *child = alloc_process();
+    if (!child)
+        return NULL;
+
+    // Share every user frame copy-on-write. The parent's own PTEs lost
+    // their write permission, so drop its cached translations.
+    child->page_table = fork_page_table(parent->page_table);
+    __asm__ __volatile__("sfence.vma zero, %0" :: "r"(parent->asid));
+
+    // The child resumes from a copy of the parent's trap frame, with fork()
+    // returning 0
+    uint32_t *frame = (uint32_t *) &child->stack[sizeof(child->stack) - sizeof(*f)];
+    struct trap_frame *child_frame = (struct trap_frame *) frame;
+    *child_frame = *f;
+    child_frame->a0 = 0;
+    child->sp = init_context(frame, fork_entry, user_pc);
+
+    child->state = PROC_RUNNABLE;
+    child->priority = parent->priority;
+    child->asid_generation = 0;
+    child->program = parent->program;
+    enqueue(child);
+    return child;
+}
+
+/**
+ * Gives the current process a writable copy of a copy-on-write page.
+ * The last process sharing a frame simply takes it over.
+ */
+static void break_cow(uint32_t *pte, vaddr_t base, size_t size) {
+    paddr_t paddr = (*pte >> 10) * PAGE_SIZE;
+    uint32_t flags = (*pte & 0x3ff & ~PAGE_COW) | PAGE_W;
+
+    if (page_refcount(paddr) > 1) {
+        paddr_t copy = alloc_pages(size / PAGE_SIZE);
+        memcpy((void *) copy, (void *) paddr, size);
+        page_put(paddr);
+        paddr = copy;
+    }
+
+    *pte = ((paddr / PAGE_SIZE) << 10) | flags;
+    __asm__ __volatile__("sfence.vma %0, %1" :: "r"(base), "r"(current_proc->asid));
+}
+
+/**
+ * Copies the file contents of a segment that belong at [base, base + size)
+ * into freshly allocated (zeroed) memory. The rest stays zero (.bss).
+ */
+static void load_segment(struct program_segment *seg, paddr_t paddr, vaddr_t base,
+                         size_t size) {
+    vaddr_t start = base > seg->vaddr ? base : seg->vaddr;
+    vaddr_t end = base + size;
+    if (end > seg->vaddr + seg->filesz)
+        end = seg->vaddr + seg->filesz;
+
+    if (start < end)
+        memcpy((void *) (paddr + (start - base)), seg->data + (start - seg->vaddr),
+               end - start);
+}
+
+bool check_user_buffer(const void *buf, uint32_t len, bool write) {
+    struct program *prog = current_proc->program;
+    if (!prog)
+        return false;
+
+    vaddr_t addr = (vaddr_t) buf;
+    vaddr_t end = addr + len;
+    if (end < addr)
+        return false;
+
+    // Walk the buffer segment by segment; any byte outside a segment would
+    // fault with nothing to page in
+    while (addr < end) {
+        struct program_segment *seg = NULL;
+        for (int i = 0; i < prog->num_segs; i++) {
+            if (addr >= prog->segs[i].vaddr
+                && addr < prog->segs[i].vaddr + prog->segs[i].memsz)
+                seg = &prog->segs[i];
         }
+
+        if (!seg || (write && !(seg->flags & PAGE_W)))
+            return false;
+
+        addr = seg->vaddr + seg->memsz;
+    }
+
+    return true;
+}
+
+bool handle_page_fault(vaddr_t vaddr, uint32_t scause) {
+    // Faults during boot, before any process exists, are kernel bugs
+    struct process *proc = current_proc;
+    if (!proc || !proc->program)
+        return false;
+
+    struct program *prog = proc->program;
+
+    struct program_segment *seg = NULL;
+    for (int i = 0; i < prog->num_segs; i++) {
+        if (vaddr >= prog->segs[i].vaddr
+            && vaddr < prog->segs[i].vaddr + prog->segs[i].memsz)
+            seg = &prog->segs[i];
+    }
+
+    if (!seg)
+        return false;
+
+    uint32_t *pte = lookup_pte(proc->page_table, vaddr);
+    if (pte && (*pte & PAGE_V)) {
+        // Writes to a shared page get a private copy; any other fault on a
+        // mapped page is a genuine protection violation
+        if (scause != SCAUSE_STORE_PAGE_FAULT || !(*pte & PAGE_COW))
+            return false;
+
+        if (pte == &proc->page_table[(vaddr >> 22) & 0x3ff])
+            break_cow(pte, align_down(vaddr, MEGAPAGE_SIZE), MEGAPAGE_SIZE);
+        else
+            break_cow(pte, align_down(vaddr, PAGE_SIZE), PAGE_SIZE);
+        return true;
+    }
+
+    // Catch writes to read-only segments and execution of data
+    if ((scause == SCAUSE_STORE_PAGE_FAULT && !(seg->flags & PAGE_W))
+        || (scause == SCAUSE_INST_PAGE_FAULT && !(seg->flags & PAGE_X)))
+        return false;
+
+    // Fill a whole 4 MB chunk of a large .bss with one megapage if nothing
+    // in that chunk has been mapped yet. File-backed chunks always go page
+    // by page so that seg->frames only ever caches 4 KB frames.
+    vaddr_t base = align_down(vaddr, PAGE_SIZE);
+    size_t size = PAGE_SIZE;
+    vaddr_t mega_base = align_down(vaddr, MEGAPAGE_SIZE);
+    if (!pte && mega_base >= seg->vaddr + seg->filesz
+        && mega_base + MEGAPAGE_SIZE <= seg->vaddr + seg->memsz) {
+        base = mega_base;
+        size = MEGAPAGE_SIZE;
+    }
+
+    uint32_t flags = PAGE_U | seg->flags;
+    paddr_t paddr;
+    if (base >= seg->vaddr + seg->filesz) {
+        // Pure .bss: a private zero page, nothing to copy
+        paddr = alloc_pages(size / PAGE_SIZE);
+    } else {
+        // Every instance of the program maps the same cached copy of a
+        // file-backed page. Read-only segments use it directly. Writable
+        // ones map it copy-on-write; the cache keeps its own reference, so
+        // writers always get a private copy, made right away on a store.
+        uint32_t index = (base - align_down(seg->vaddr, PAGE_SIZE)) / PAGE_SIZE;
+        paddr = seg->frames[index];
+        if (!paddr) {
+            paddr = alloc_pages(size / PAGE_SIZE);
+            load_segment(seg, paddr, base, size);
+            seg->frames[index] = paddr;
+        }
+
+        if (scause == SCAUSE_STORE_PAGE_FAULT) {
+            paddr_t copy = alloc_pages(size / PAGE_SIZE);
+            memcpy((void *) copy, (void *) paddr, size);
+            paddr = copy;
+        } else {
+            page_get(paddr);
+            if (flags & PAGE_W)
+                flags = (flags & ~PAGE_W) | PAGE_COW;
+        }
+    }
+
+    if (size == MEGAPAGE_SIZE)
+        map_megapage(proc->page_table, base, paddr, flags);
+    else
+        map_page(proc->page_table, base, paddr, flags);
+
+    __asm__ __volatile__("sfence.vma %0, %1" :: "r"(base), "r"(proc->asid));
+    return true;
+}
+
+/**
+ * Releases the address space of an exited process and returns its slot to
+ * PROC_UNUSED. Must not be called while the process's page table is active.
+ */
+static void reap_process(struct process *proc) {
+    free_page_table(proc->page_table);
+    proc->page_table = NULL;
+    proc->state = PROC_UNUSED;
+    proc->run_next = free_procs;
+    free_procs = proc;
+}
+
+/**
+ * Gives the process an ASID from the current generation if it does not
+ * already hold one. Returns true if the whole TLB must be flushed because
+ * the ASID space wrapped around.
+ */
+static bool assign_asid(struct process *proc) {
+    if (proc->asid_generation == asid_generation)
+        return false;
+
+    bool rollover = false;
+    if (next_asid >= num_asids) {
+        // Out of ASIDs: every process gets a new one lazily
+        asid_generation++;
+        next_asid = 1;
+        rollover = true;
     }
 
+    proc->asid = next_asid++;
+    proc->asid_generation = asid_generation;
+    return rollover;
+}
+
+void sleep_on(struct wait_queue *queue) {
+    current_proc->state = PROC_BLOCKED;
+    current_proc->wait_next = queue->head;
+    queue->head = current_proc;
+    yield();
+}
+
+void wake_up(struct wait_queue *queue) {
+    // Sleepers go ahead of the processes already queued: they are waiting
+    // on I/O, and should not wait a time slice per CPU-bound process
+    struct process *proc = queue->head;
+    while (proc) {
+        struct process *next = proc->wait_next;
+        proc->wait_next = NULL;
+        proc->state = PROC_RUNNABLE;
+        enqueue_front(proc);
+        need_resched = true;
+        proc = next;
+    }
+    queue->head = NULL;
+}
+
+int set_priority(int priority) {
+    if (priority < 0 || priority >= PRIO_LEVELS)
+        return -1;
+
+    // The caller is running, so it is on no run queue and can simply move
+    int old = current_proc->priority;
+    current_proc->priority = priority;
+    return old;
+}
+
+void yield(void) {
+    need_resched = false;
+
+    // A process that is still runnable goes to the back of its queue, so
+    // processes of equal priority take turns
+    if (current_proc != idle_proc && current_proc->state == PROC_RUNNABLE)
+        enqueue(current_proc);
+
+    // Run the highest-priority runnable process, or idle if there is none
+    struct process *next = dequeue();
+    if (!next)
+        next = idle_proc;
+
     if (next == current_proc)
         return;
 
-    // Update page table and scratch register for new process
-    __asm__ __volatile__(
-        "sfence.vma\n"
-        "csrw satp, %[satp]\n"
-        "sfence.vma\n"
-        "csrw sscratch, %[sscratch]\n"
-        :
-        : [satp] "r" (SATP_SV32 | ((uint32_t) next->page_table / PAGE_SIZE)),
-          [sscratch] "r" ((uint32_t) &next->stack[sizeof(next->stack)])
-    );
+    // Nothing needs preempting while idle, so park the timer and let wfi
+    // sleep until a device interrupt; a real process gets a fresh slice
+    if (next == idle_proc)
+        timer_stop();
+    else if (current_proc == idle_proc)
+        timer_set_next();
 
-    // Perform context switch
+    // Update page table for new process. Translations
+    // tagged with other ASIDs stay in the TLB, so only a wrap of the ASID
+    // space needs a full flush. A newly assigned ASID is flushed on its own
+    // so the walker sees the freshly written page table.
+    bool new_asid = next->asid_generation != asid_generation;
+    bool flush_all = assign_asid(next);
+    WRITE_CSR(satp, SATP_SV32 | (next->asid << SATP_ASID_SHIFT)
+                    | ((uint32_t) next->page_table / PAGE_SIZE));
+
+    if (flush_all)
+        __asm__ __volatile__("sfence.vma");
+    else if (new_asid)
+        __asm__ __volatile__("sfence.vma zero, %0" :: "r"(next->asid));
+
+    // The exiting process is no longer on satp, so its memory can go.
+    // Its kernel stack lives in procs[] and stays valid for the switch below.
     struct process *prev = current_proc;
+    if (prev->state == PROC_EXITED)
+        reap_process(prev);
+
+    // Perform context switch
     current_proc = next;
     switch_context(&prev->sp, &next->sp);
 }
\ No newline at end of file
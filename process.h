@@ -6,20 +6,81 @@
 extern struct process procs[PROCS_MAX];
 extern struct process *current_proc;
 extern struct process *idle_proc;
+extern bool need_resched;   // Set by wake_up() until the next yield()
 
 /**
  * Creates a new process with the given user image.
- * Sets up page tables, maps kernel and user pages, and initializes the stack.
+ * Sets up the page table and initializes the stack. User pages are mapped
+ * lazily from the image's PT_LOAD segments on first touch.
  *
- * @param image - Pointer to the user program binary
- * @param image_size - Size of the user program in bytes
+ * @param image - Pointer to the user program ELF executable (NULL for idle)
  * @return Pointer to the created process
  */
-struct process *create_process(const void *image, size_t image_size);
+struct process *create_process(const void *image);
 
 /**
- * Performs cooperative multitasking by switching to the next runnable process.
- * Uses round-robin scheduling.
+ * Creates a child of the current process that shares its memory
+ * copy-on-write and resumes in user mode with fork() returning 0.
+ *
+ * @param f - Trap frame of the parent's fork system call
+ * @param user_pc - User program counter the child resumes at
+ * @return Pointer to the child process, or NULL if the process table is
+ *         full
+ */
+struct process *fork_process(struct trap_frame *f, uint32_t user_pc);
+
+/**
+ * Resolves a page fault on the current process: pages in untouched parts
+ * of its segments (a page or a whole megapage, zero-filled for .bss), and
+ * gives writes to copy-on-write pages a private copy.
+ *
+ * @param vaddr - Faulting virtual address (stval)
+ * @param scause - Fault cause (instruction, load or store page fault)
+ * @return true if the page was mapped and the access can be retried
+ */
+bool handle_page_fault(vaddr_t vaddr, uint32_t scause);
+
+/**
+ * Checks that a buffer passed in by the current process lies entirely
+ * within its program's segments, so the kernel can touch it without an
+ * unresolvable page fault.
+ *
+ * @param buf - User virtual address of the buffer
+ * @param len - Length of the buffer in bytes
+ * @param write - true if the kernel will write into the buffer
+ * @return true if every byte is mapped or can be paged in with the
+ *         required access
+ */
+bool check_user_buffer(const void *buf, uint32_t len, bool write);
+
+/**
+ * Blocks the current process on a wait queue until wake_up() is called on
+ * it. Callers re-check their condition afterwards, since every sleeper on
+ * the queue is woken.
+ *
+ * @param queue - Queue to sleep on
+ */
+void sleep_on(struct wait_queue *queue);
+
+/**
+ * Makes every process sleeping on a wait queue runnable again, ahead of
+ * the processes already waiting to run, and sets need_resched.
+ *
+ * @param queue - Queue to wake
+ */
+void wake_up(struct wait_queue *queue);
+
+/**
+ * Changes the scheduling priority of the current process.
+ *
+ * @param priority - New priority, 0 (highest) to PRIO_LEVELS - 1
+ * @return The previous priority, or -1 if priority is out of range
+ */
+int set_priority(int priority);
+
+/**
+ * Switches to the highest-priority runnable process. Processes of equal
+ * priority run round-robin; the idle process runs when none is runnable.
  */
 void yield(void);
 
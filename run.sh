@@ -15,21 +15,22 @@ CFLAGS="-std=c11 -O2 -g3 -Wall -Wextra --target=riscv32-unknown-elf -fuse-ld=lld
 $CC $CFLAGS -Wl,-Tuser.ld -Wl,-Map=shell.map -o shell.elf \
     shell.c user.c common.c
 
-# Convert the executable elf to raw binary
-$OBJCOPY --set-section-flags .bss=alloc,contents \
-    -O binary shell.elf shell.bin
+# Strip the executable elf; the kernel only needs its program headers
+$OBJCOPY --strip-all shell.elf shell.stripped.elf
 
-# Convert the raw binary image to a format that is embedded in C
-$OBJCOPY -Ibinary -Oelf32-littleriscv shell.bin shell.bin.o
+# Convert the elf image to a format that is embedded in C
+$OBJCOPY -Ibinary -Oelf32-littleriscv shell.stripped.elf shell.stripped.elf.o
 
 # Build kernel
 $CC $CFLAGS -Wl,-Tkernel.ld -Wl,-Map=kernel.map -o kernel.elf \
-    kernel.c common.c memory.c virtio.c fs.c process.c trap.c shell.bin.o
+    kernel.c common.c memory.c virtio.c fs.c process.c trap.c console.c timer.c \
+    plic.c uart.c shell.stripped.elf.o
 
 (cd disk && tar cf ../disk.tar --format=ustar *.txt)
 
 $QEMU \
     -machine virt \
+    -cpu rv32,v=true,vlen=128 \
     -bios default \
     -nographic \
     -serial mon:stdio \
@@ -8,20 +8,21 @@ void main(void) {
 prompt:
         printf("> ");
         char cmdline[128];
-        for (int i = 0;; i++) {
-            char ch = getchar();
-            putchar(ch);
-            if (i == sizeof(cmdline) - 1) {
-                printf("command line too long :^(\n");
-                goto prompt;
-            } else if (ch == '\r') {
-                printf("\n");
-                cmdline[i] = '\0';
-                break;
-            } else {
-                cmdline[i] = ch;
-            }
+        int len = read(STDIN_FILENO, cmdline, sizeof(cmdline));
+        if (len <= 0) {
+            // Nothing read: report an error, or just prompt again
+            if (len < 0)
+                printf("read failed :^(\n");
+            goto prompt;
+        }
+        if (cmdline[len - 1] != '\n') {
+            // Discard the rest of an overlong line
+            while (len > 0 && cmdline[len - 1] != '\n')
+                len = read(STDIN_FILENO, cmdline, sizeof(cmdline));
+            printf("command line too long :^(\n");
+            goto prompt;
         }
+        cmdline[len - 1] = '\0';
         if (strcmp(cmdline, "hello") == 0)
             printf("Hello world from shell!\n");
         else if (strcmp(cmdline, "readfile") == 0) {
@@ -32,6 +33,17 @@ prompt:
         }
         else if (strcmp(cmdline, "writefile") == 0)
             writefile("hello.txt", "Hello from shell!\n", 19);
+        else if (strcmp(cmdline, "fork") == 0) {
+            int pid = fork();
+            if (pid == 0) {
+                printf("Hello from forked child!\n");
+                exit();
+            }
+            if (pid < 0)
+                printf("fork failed :^(\n");
+            else
+                printf("forked child %d\n", pid);
+        }
         else if (strcmp(cmdline, "exit") == 0)
             exit();
         else
@@ -0,0 +1,41 @@
+#include "timer.h"
+
+/* SBI Timer extension */
+#define SBI_EXT_TIME        0x54494d45  // "TIME"
+#define SBI_TIME_SET_TIMER  0
+
+#define TIME_SLICE_TICKS    ((uint64_t) TIMEBASE_FREQ / 1000 * TIME_SLICE_MS)
+
+uint64_t timer_now(void) {
+    uint32_t hi, lo;
+
+    // Re-read if the low half wrapped between reading the two halves
+    do {
+        hi = READ_CSR(timeh);
+        lo = READ_CSR(time);
+    } while (hi != READ_CSR(timeh));
+
+    return (uint64_t) hi << 32 | lo;
+}
+
+/**
+ * Sets the absolute time at which the next timer interrupt fires.
+ */
+static void set_timer(uint64_t deadline) {
+    // On RV32 the 64-bit deadline is passed in a0 (low) and a1 (high)
+    sbi_call((uint32_t) deadline, (uint32_t) (deadline >> 32), 0, 0, 0, 0,
+             SBI_TIME_SET_TIMER, SBI_EXT_TIME);
+}
+
+void timer_set_next(void) {
+    set_timer(timer_now() + TIME_SLICE_TICKS);
+}
+
+void timer_stop(void) {
+    set_timer(UINT64_MAX);
+}
+
+void timer_init(void) {
+    timer_set_next();
+    WRITE_CSR(sie, READ_CSR(sie) | SIE_STIE);
+}
@@ -0,0 +1,26 @@
+#pragma once
+#include "common.h"
+#include "kernel.h"
+
+/**
+ * Enables supervisor timer interrupts and arms the first time slice.
+ */
+void timer_init(void);
+
+/**
+ * Arms the timer to fire one time slice from now.
+ * Also clears the pending timer interrupt.
+ */
+void timer_set_next(void);
+
+/**
+ * Pushes the timer deadline out of reach, so no timer interrupt fires
+ * until timer_set_next() is called again.
+ * Also clears the pending timer interrupt.
+ */
+void timer_stop(void);
+
+/**
+ * Reads the 64-bit time counter (TIMEBASE_FREQ ticks per second).
+ */
+uint64_t timer_now(void);
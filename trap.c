@@ -1,32 +1,30 @@
 #include "trap.h"
 #include "process.h"
 #include "fs.h"
-
-/* SBI calls for console I/O */
-extern void putchar(char ch);
-extern long getchar(void);
+#include "console.h"
+#include "timer.h"
+#include "plic.h"
+#include "uart.h"
+#include "virtio.h"
 
 /**
  * Handles system calls from user mode.
  * System call number is in a3, arguments in a0-a2.
  * Return value is placed in a0.
+ *
+ * @param f - Trap frame of the calling process
+ * @param next_pc - Address of the instruction after the ecall
  */
-static void handle_syscall(struct trap_frame *f) {
+static void handle_syscall(struct trap_frame *f, uint32_t next_pc) {
     switch (f->a3) {
         case SYS_PUTCHAR:
             putchar(f->a0);
+            console_flush();
             break;
 
         case SYS_GETCHAR:
-            // Poll for character, yielding to other processes while waiting
-            while (1) {
-                long ch = getchar();
-                if (ch >= 0) {
-                    f->a0 = ch;
-                    break;
-                }
-                yield();
-            }
+            // Sleeps until a character arrives
+            f->a0 = console_getchar();
             break;
 
         case SYS_READFILE:
@@ -57,15 +55,60 @@ static void handle_syscall(struct trap_frame *f) {
             break;
         }
 
+        case SYS_WRITE: {
+            int fd = f->a0;
+            const char *buf = (const char *) f->a1;
+            int len = f->a2;
+
+            if ((fd != STDOUT_FILENO && fd != STDERR_FILENO) || len < 0
+                || !check_user_buffer(buf, len, false)) {
+                f->a0 = -1;
+                break;
+            }
+
+            console_write(buf, len);
+            f->a0 = len;
+            break;
+        }
+
+        case SYS_READ: {
+            int fd = f->a0;
+            char *buf = (char *) f->a1;
+            int len = f->a2;
+
+            if (fd != STDIN_FILENO || len < 0
+                || !check_user_buffer(buf, len, true)) {
+                f->a0 = -1;
+                break;
+            }
+
+            f->a0 = tty_read(buf, len);
+            break;
+        }
+
+        case SYS_TTYMODE:
+            f->a0 = tty_set_mode(f->a0);
+            break;
+
+        case SYS_SETPRIORITY:
+            f->a0 = set_priority(f->a0);
+            break;
+
+        case SYS_FORK: {
+            // The child resumes after the ecall
+            struct process *child = fork_process(f, next_pc);
+            f->a0 = child ? child->pid : -1;
+            break;
+        }
+
         case SYS_EXIT:
             printf("process %d exited\n", current_proc->pid);
             current_proc->state = PROC_EXITED;
+            // The TTY mode is global: don't leave the next reader in raw mode
+            tty_release(current_proc);
 
-            /* Note:
-             * A production OS would free resources held by the exited process
-             * such as page tables and allocated memory.
-             */
-
+            // yield() frees the page tables and user pages once it has
+            // switched away, and returns the slot to PROC_UNUSED
             yield();
             PANIC("unreachable");
 
@@ -78,17 +121,58 @@ void handle_trap(struct trap_frame *f) {
     uint32_t scause = READ_CSR(scause);
     uint32_t stval = READ_CSR(stval);
     uint32_t user_pc = READ_CSR(sepc);
+    // Saved like sepc: a nested trap or a yield() would clobber sstatus.SPP
+    uint32_t sstatus = READ_CSR(sstatus);
+
+    // The vector unit is for the kernel only: it is switched on while the
+    // trap is handled and off again (via sstatus) when returning to user
+    // mode, so there is never user vector state to save
+    if (has_vector)
+        WRITE_CSR(sstatus, sstatus | SSTATUS_VS_INITIAL);
 
-    if (scause == SCAUSE_ECALL) {
+    if (scause == (SCAUSE_INTERRUPT | SCAUSE_S_TIMER)) {
+        // Time slice used up: re-arm the timer and let another process run.
+        // Only user mode and the idle loop run with interrupts enabled, so
+        // this never preempts kernel work. The idle process has no slice.
+        if (current_proc == idle_proc)
+            timer_stop();
+        else
+            timer_set_next();
+        yield();
+    } else if (scause == (SCAUSE_INTERRUPT | SCAUSE_S_EXTERNAL)) {
+        // Device interrupt: ask the PLIC which device raised it
+        uint32_t irq = plic_claim();
+        if (irq == UART_IRQ)
+            uart_handle_irq();
+        else if (irq == VIRTIO_BLK_IRQ)
+            virtio_blk_handle_irq();
+        else if (irq)
+            printf("unexpected irq %d\n", irq);
+
+        if (irq)
+            plic_complete(irq);
+
+        // Run a process woken by the device now rather than at the end of
+        // the current time slice
+        if (need_resched)
+            yield();
+    } else if (scause == SCAUSE_ECALL) {
         // Handle system call from user mode
-        handle_syscall(f);
         user_pc += 4;  // Skip past the ecall instruction
+        handle_syscall(f, user_pc);
+    } else if (scause == SCAUSE_INST_PAGE_FAULT || scause == SCAUSE_LOAD_PAGE_FAULT
+               || scause == SCAUSE_STORE_PAGE_FAULT) {
+        // Page in user memory on first touch, then retry the instruction.
+        // The access may come from the kernel itself through SSTATUS_SUM.
+        if (!handle_page_fault(stval, scause))
+            PANIC("page fault scause=%x, stval=%x, sepc=%x\n", scause, stval, user_pc);
     } else {
         // Unexpected trap
         PANIC("unexpected trap scause=%x, stval=%x, sepc=%x\n", scause, stval, user_pc);
     }
 
     WRITE_CSR(sepc, user_pc);
+    WRITE_CSR(sstatus, sstatus);
 }
 
 /**
@@ -96,7 +180,11 @@ void handle_trap(struct trap_frame *f) {
  * This is the first code that runs when a trap (exception/interrupt/syscall) occurs.
  *
  * It saves all registers to a trap frame on the kernel stack, calls handle_trap,
- * then restores all registers and returns to user mode.
+ * then restores all registers and returns to the interrupted mode.
+ *
+ * sscratch holds the top of the current kernel stack while in user mode and
+ * zero while in the kernel, so a trap taken in the kernel (e.g. a page fault
+ * on a user buffer) keeps using the stack it was already on.
  */
 __attribute__((naked))
 __attribute__((aligned(4)))
@@ -104,6 +192,11 @@ void kernel_entry(void) {
     __asm__ __volatile__(
         // Swap sp with sscratch to get kernel stack pointer
         "csrrw sp, sscratch, sp\n"
+        "bnez sp, 1f\n"
+
+        // Trapped from the kernel: sscratch was zero, keep the current stack
+        "csrr sp, sscratch\n"
+        "1:\n"
 
         // Allocate space for trap frame and save all registers
         "addi sp, sp, -4 * 31\n"
@@ -138,18 +231,28 @@ void kernel_entry(void) {
         "sw s10, 4 * 28(sp)\n"
         "sw s11, 4 * 29(sp)\n"
 
-        // Save user stack pointer (currently in sscratch)
+        // Save interrupted stack pointer (currently in sscratch)
         "csrr a0, sscratch\n"
         "sw a0, 4 * 30(sp)\n"
 
-        // Reset kernel stack pointer in sscratch
-        "addi a0, sp, 4 * 31\n"
-        "csrw sscratch, a0\n"
+        // Mark that we are running in the kernel
+        "csrw sscratch, zero\n"
 
         // Call high-level trap handler with trap frame pointer
         "mv a0, sp\n"
         "call handle_trap\n"
 
+        // Returning to user mode: reset kernel stack pointer in sscratch.
+        // fork_entry() also starts a new child from here.
+        ".global trap_return\n"
+        "trap_return:\n"
+        "csrr a0, sstatus\n"
+        "andi a0, a0, %[spp]\n"
+        "bnez a0, 2f\n"
+        "addi a0, sp, 4 * 31\n"
+        "csrw sscratch, a0\n"
+        "2:\n"
+
         // Restore all registers from trap frame
         "lw ra, 4 * 0(sp)\n"
         "lw gp, 4 * 1(sp)\n"
@@ -183,7 +286,9 @@ void kernel_entry(void) {
         "lw s11, 4 * 29(sp)\n"
         "lw sp, 4 * 30(sp)\n"
 
-        // Return to user mode
+        // Return to the interrupted mode
         "sret\n"
+        :
+        : [spp] "i" (SSTATUS_SPP)
     );
 }
\ No newline at end of file
@@ -0,0 +1,23 @@
+#include "uart.h"
+#include "plic.h"
+#include "console.h"
+
+/* UART register access helpers */
+static uint8_t uart_reg_read(unsigned offset) {
+    return *((volatile uint8_t *) (UART_PADDR + offset));
+}
+
+static void uart_reg_write(unsigned offset, uint8_t value) {
+    *((volatile uint8_t *) (UART_PADDR + offset)) = value;
+}
+
+void uart_init(void) {
+    uart_reg_write(UART_REG_IER, UART_IER_RX_AVAIL);
+    plic_enable(UART_IRQ);
+}
+
+void uart_handle_irq(void) {
+    // Drain the receive FIFO; the interrupt stays raised until it is empty
+    while (uart_reg_read(UART_REG_LSR) & UART_LSR_DATA_READY)
+        console_receive(uart_reg_read(UART_REG_RBR));
+}
@@ -0,0 +1,14 @@
+#pragma once
+#include "common.h"
+#include "kernel.h"
+
+/**
+ * Enables the UART receive interrupt and routes it through the PLIC.
+ */
+void uart_init(void);
+
+/**
+ * Handles a UART interrupt by passing every received character to the
+ * console input buffer.
+ */
+void uart_handle_irq(void);
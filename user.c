@@ -2,6 +2,12 @@
 
 extern char __stack_top[];
 
+#define STDOUT_BUF_SIZE 128
+
+/* Line-buffered stdout, written out with one SYS_WRITE per flush */
+static char stdout_buf[STDOUT_BUF_SIZE];
+static int stdout_len;
+
 int syscall(int sysno, int arg0, int arg1, int arg2) {
     /**
      * set syscall in a3, args in a0, a1, and a2, then exec ecall.
@@ -22,15 +28,41 @@ int syscall(int sysno, int arg0, int arg1, int arg2) {
 
 __attribute__((noreturn)) 
 void exit(void) {
+    flush();
     syscall(SYS_EXIT, 0, 0, 0);
     for (;;);
 }
 
+int write(int fd, const char *buf, int len) {
+    return syscall(SYS_WRITE, fd, (int) buf, len);
+}
+
+int read(int fd, char *buf, int len) {
+    // Show any pending output (e.g. a prompt) before blocking
+    flush();
+    return syscall(SYS_READ, fd, (int) buf, len);
+}
+
+int ttymode(int mode) {
+    return syscall(SYS_TTYMODE, mode, 0, 0);
+}
+
+void flush(void) {
+    if (stdout_len > 0) {
+        write(STDOUT_FILENO, stdout_buf, stdout_len);
+        stdout_len = 0;
+    }
+}
+
 void putchar(char ch) {
-    syscall(SYS_PUTCHAR, ch, 0, 0);
+    stdout_buf[stdout_len++] = ch;
+    if (ch == '\n' || stdout_len == STDOUT_BUF_SIZE)
+        flush();
 }
 
 int getchar(void) {
+    // Show any pending output (e.g. a prompt or echo) before blocking
+    flush();
     return syscall(SYS_GETCHAR, 0, 0, 0);
 }
 
@@ -42,6 +74,16 @@ int writefile(const char *filename, const char *buf, int len) {
     return syscall(SYS_WRITEFILE, (int) filename, (int) buf, len);
 }
 
+int setpriority(int priority) {
+    return syscall(SYS_SETPRIORITY, priority, 0, 0);
+}
+
+int fork(void) {
+    // Flush first so buffered output is not printed by both processes
+    flush();
+    return syscall(SYS_FORK, 0, 0, 0);
+}
+
 __attribute__((section(".text.start")))
 __attribute((naked))
 void start(void) {
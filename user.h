@@ -2,7 +2,19 @@
 #include "common.h"
 
 __attribute__((noreturn)) void exit(void);
+int read(int fd, char *buf, int len);
+int write(int fd, const char *buf, int len);
+int ttymode(int mode);
+void flush(void);
 void putchar(char ch);
 int getchar(void);
 int readfile(const char *filename, char *buf, int len);
 int writefile(const char *filename, const char *buf, int len);
+/**
+ * Duplicates the calling process.
+ *
+ * @return The child's pid in the parent, 0 in the child, or -1 if the
+ *         process table is full
+ */
+int fork(void);
+int setpriority(int priority);
@@ -1,11 +1,24 @@
 #include "virtio.h"
 #include "memory.h"
+#include "process.h"
+#include "plic.h"
+
+extern char __kernel_base[], __free_ram_end[];
 
 /* VirtIO block device state */
 static struct virtio_virtq *blk_request_vq;
-static struct virtio_blk_req *blk_req;
-static paddr_t blk_req_paddr;
 static uint64_t blk_capacity;
+static uint32_t blk_features;   // Negotiated VIRTIO_RING_F_* bits
+
+/* Requests in flight, indexed by the head descriptor of their chain */
+static struct {
+    struct virtio_blk_req *req;     // Header and status
+    struct virtq_desc *indirect;    // Indirect descriptor table, if used
+    struct virtio_blk_completion *completion;
+} blk_inflight[VIRTQ_ENTRY_NUM];
+
+/* Processes waiting for a request or a free descriptor chain */
+static struct wait_queue blk_waiters;
 
 /* VirtIO register access helpers */
 static uint32_t virtio_reg_read32(unsigned offset) {
@@ -33,6 +46,12 @@ static struct virtio_virtq *virtq_init(unsigned index) {
     vq->queue_index = index;
     vq->used_index = (volatile uint16_t *) &vq->used.index;
 
+    // Chain every descriptor into the free list
+    for (int i = 0; i < VIRTQ_ENTRY_NUM; i++)
+        vq->descs[i].next = i + 1;
+    vq->free_head = 0;
+    vq->num_free = VIRTQ_ENTRY_NUM;
+
     // 1. Select the queue writing its index to QueueSel
     virtio_reg_write32(VIRTIO_REG_QUEUE_SEL, index);
     // 5. Notify device about queue size
@@ -44,23 +63,55 @@ static struct virtio_virtq *virtq_init(unsigned index) {
     return vq;
 }
 
+/**
+ * Takes a descriptor off the free list. The caller checks num_free first.
+ */
+static uint16_t virtq_alloc_desc(struct virtio_virtq *vq) {
+    uint16_t index = vq->free_head;
+    vq->free_head = vq->descs[index].next;
+    vq->num_free--;
+    return index;
+}
+
+/**
+ * Returns a descriptor chain to the free list.
+ */
+static void virtq_free_chain(struct virtio_virtq *vq, uint16_t head) {
+    uint16_t index = head;
+    while (1) {
+        vq->num_free++;
+        if (!(vq->descs[index].flags & VIRTQ_DESC_F_NEXT))
+            break;
+        index = vq->descs[index].next;
+    }
+
+    vq->descs[index].next = vq->free_head;
+    vq->free_head = head;
+}
+
 /**
  * Notifies the device of a new request by updating the available ring
  * and kicking the queue notify register.
  */
 static void virtq_kick(struct virtio_virtq *vq, int desc_index) {
-    vq->avail.ring[vq->avail.index % VIRTQ_ENTRY_NUM] = desc_index;
-    vq->avail.index++;
+    uint16_t old_index = vq->avail.index;
+    vq->avail.ring[old_index % VIRTQ_ENTRY_NUM] = desc_index;
+    // The device must see the ring entry before the new index
+    __sync_synchronize();
+    vq->avail.index = old_index + 1;
     __sync_synchronize();
-    virtio_reg_write32(VIRTIO_REG_QUEUE_NOTIFY, vq->queue_index);
-    vq->last_used_index++;
-}
 
-/**
- * Returns true if there are outstanding requests being processed.
- */
-static bool virtq_is_busy(struct virtio_virtq *vq) {
-    return vq->last_used_index != *vq->used_index;
+    // With EVENT_IDX the device publishes the avail index it next wants to
+    // hear about; while it is still working through the ring, skip the
+    // notify (an MMIO exit) unless this entry moves past that index
+    if (blk_features & VIRTIO_RING_F_EVENT_IDX) {
+        uint16_t event = vq->used.avail_event;
+        uint16_t new_index = old_index + 1;
+        if ((uint16_t) (new_index - event - 1) >= (uint16_t) (new_index - old_index))
+            return;
+    }
+
+    virtio_reg_write32(VIRTIO_REG_QUEUE_NOTIFY, vq->queue_index);
 }
 
 void virtio_blk_init(void) {
@@ -79,6 +130,12 @@ void virtio_blk_init(void) {
     virtio_reg_fetch_and_or32(VIRTIO_REG_DEVICE_STATUS, VIRTIO_STATUS_ACK);
     // 3. Set DRIVER status bit
     virtio_reg_fetch_and_or32(VIRTIO_REG_DEVICE_STATUS, VIRTIO_STATUS_DRIVER);
+    // 4. Read device feature bits and accept the ones the driver uses
+    virtio_reg_write32(VIRTIO_REG_HOST_FEATURES_SEL, 0);
+    blk_features = virtio_reg_read32(VIRTIO_REG_HOST_FEATURES)
+                   & (VIRTIO_RING_F_INDIRECT_DESC | VIRTIO_RING_F_EVENT_IDX);
+    virtio_reg_write32(VIRTIO_REG_GUEST_FEATURES_SEL, 0);
+    virtio_reg_write32(VIRTIO_REG_GUEST_FEATURES, blk_features);
     // 5. Set FEATURES_OK status bit
     virtio_reg_fetch_and_or32(VIRTIO_REG_DEVICE_STATUS, VIRTIO_STATUS_FEAT_OK);
     // 7. Device-specific setup, including discovery of virtqueues
@@ -89,59 +146,233 @@ void virtio_blk_init(void) {
     // Read disk capacity from device config space
     blk_capacity = virtio_reg_read64(VIRTIO_REG_DEVICE_CONFIG + 0) * SECTOR_SIZE;
     printf("virtio-blk: capacity is %d bytes\n", (uint32_t)blk_capacity);
+    printf("virtio-blk: indirect descriptors %s, event index %s\n",
+           blk_features & VIRTIO_RING_F_INDIRECT_DESC ? "on" : "off",
+           blk_features & VIRTIO_RING_F_EVENT_IDX ? "on" : "off");
 
-    // Allocate a region to store requests to the device
-    blk_req_paddr = alloc_pages(align_up(sizeof(*blk_req), PAGE_SIZE) / PAGE_SIZE);
-    blk_req = (struct virtio_blk_req *) blk_req_paddr;
+    // Completions are signalled through the PLIC
+    plic_enable(VIRTIO_BLK_IRQ);
 }
 
-void read_write_disk(void *buf, unsigned sector, int is_write) {
-    if (sector >= blk_capacity / SECTOR_SIZE) {
+/**
+ * Returns true if the device can transfer to or from buf directly. Kernel
+ * memory is identity-mapped, so its addresses are already physical; any
+ * other buffer goes through a bounce buffer.
+ */
+static bool blk_can_dma(const void *buf, uint32_t len) {
+    vaddr_t vaddr = (vaddr_t) buf;
+    return vaddr >= (vaddr_t) __kernel_base && vaddr + len <= (vaddr_t) __free_ram_end;
+}
+
+/**
+ * Returns true if the caller may sleep while waiting for the device. At
+ * boot there is no process yet, and the idle process must never block, so
+ * both poll instead.
+ */
+static bool blk_can_sleep(void) {
+    return current_proc && current_proc != idle_proc;
+}
+
+/**
+ * Waits for the device to complete something, sleeping if possible.
+ */
+static void blk_wait_for_device(void) {
+    if (virtio_blk_poll())
+        return;
+
+    // Interrupts are off in the kernel, so a completion cannot slip in
+    // between the poll above and going to sleep
+    if (blk_can_sleep())
+        sleep_on(&blk_waiters);
+}
+
+void virtio_blk_handle_irq(void) {
+    virtio_reg_write32(VIRTIO_REG_INTERRUPT_ACK,
+                       virtio_reg_read32(VIRTIO_REG_INTERRUPT_STATUS));
+    virtio_blk_poll();
+}
+
+bool virtio_blk_poll(void) {
+    struct virtio_virtq *vq = blk_request_vq;
+    bool completed = false;
+
+    while (1) {
+        while (vq->last_used_index != *vq->used_index) {
+            // Read the used element only after seeing the index move
+            __sync_synchronize();
+            uint16_t head = vq->used.ring[vq->last_used_index % VIRTQ_ENTRY_NUM].id;
+            vq->last_used_index++;
+
+            struct virtio_blk_req *req = blk_inflight[head].req;
+            struct virtio_blk_completion *completion = blk_inflight[head].completion;
+
+            // Check status: 0 = success, non-zero = error
+            if (req->status != 0) {
+                printf("virtio: warn: failed to read/write sector=%d status=%d\n",
+                       (uint32_t) req->sector, req->status);
+            }
+
+            completion->status = req->status;
+            completion->done = true;
+
+            kfree(blk_inflight[head].indirect);
+            kfree(req);
+            blk_inflight[head].req = NULL;
+            virtq_free_chain(vq, head);
+            completed = true;
+        }
+
+        // With EVENT_IDX, ask for an interrupt only at the next completion,
+        // not for entries already consumed. One may have landed before the
+        // device saw the new used_event, so check the ring once more.
+        if (!(blk_features & VIRTIO_RING_F_EVENT_IDX)
+            || vq->avail.used_event == vq->last_used_index)
+            break;
+        vq->avail.used_event = vq->last_used_index;
+        __sync_synchronize();
+    }
+
+    // Whoever polled, the owners of finished requests must wake up
+    if (completed)
+        wake_up(&blk_waiters);
+    return completed;
+}
+
+void virtio_blk_submit(struct virtio_blk_completion *completion, void *buf,
+                       unsigned sector, unsigned count, int is_write) {
+    completion->done = false;
+    completion->status = 0;
+    completion->data = NULL;
+    completion->buf = NULL;
+
+    if (count == 0 || count > VIRTIO_BLK_MAX_SECTORS)
+        PANIC("virtio: invalid request size %d sectors", count);
+
+    if (sector + count > blk_capacity / SECTOR_SIZE) {
         printf("virtio: tried to read/write sector=%d, but capacity is %d\n",
-               sector, blk_capacity / SECTOR_SIZE);
+               sector + count - 1, blk_capacity / SECTOR_SIZE);
+        completion->status = VIRTIO_BLK_S_IOERR;
+        completion->done = true;
         return;
     }
 
-    // Construct request according to virtio-blk spec
-    blk_req->sector = sector;
-    blk_req->type = is_write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
-    if (is_write)
-        memcpy(blk_req->data, buf, SECTOR_SIZE);
+    // Transfer straight to or from kernel memory; bounce anything else
+    // through a kmalloc buffer (physically contiguous even when it spans
+    // pages). Reads are copied out in virtio_blk_wait(), which runs in the
+    // submitter's address space.
+    uint32_t len = count * SECTOR_SIZE;
+    paddr_t data_paddr = (paddr_t) buf;
+    if (!blk_can_dma(buf, len)) {
+        completion->data = kmalloc(len);
+        completion->len = len;
+        if (is_write)
+            memcpy(completion->data, buf, len);
+        else
+            completion->buf = buf;
+        data_paddr = (paddr_t) completion->data;
+    }
+
+    // With indirect descriptors the chain lives in a table of its own and
+    // takes a single ring slot
+    bool indirect = blk_features & VIRTIO_RING_F_INDIRECT_DESC;
+    int num_descs = 3;
 
-    // Construct virtqueue descriptors (3-part descriptor chain)
+    // Wait for an earlier request to finish if the descriptors are in use
     struct virtio_virtq *vq = blk_request_vq;
-    // Descriptor 0: Request header (type, sector)
-    vq->descs[0].addr = blk_req_paddr;
-    vq->descs[0].len = sizeof(uint32_t) * 2 + sizeof(uint64_t);
-    vq->descs[0].flags = VIRTQ_DESC_F_NEXT;
-    vq->descs[0].next = 1;
-
-    // Descriptor 1: Data buffer (read or write)
-    vq->descs[1].addr = blk_req_paddr + offsetof(struct virtio_blk_req, data);
-    vq->descs[1].len = SECTOR_SIZE;
-    vq->descs[1].flags = VIRTQ_DESC_F_NEXT | (is_write ? 0 : VIRTQ_DESC_F_WRITE);
-    vq->descs[1].next = 2;
-
-    // Descriptor 2: Status byte (device writes result here)
-    vq->descs[2].addr = blk_req_paddr + offsetof(struct virtio_blk_req, status);
-    vq->descs[2].len = sizeof(uint8_t);
-    vq->descs[2].flags = VIRTQ_DESC_F_WRITE;
+    while (vq->num_free < (indirect ? 1 : num_descs))
+        blk_wait_for_device();
+
+    // Construct request according to virtio-blk spec
+    struct virtio_blk_req *req = kmalloc(sizeof(*req));
+    paddr_t req_paddr = (paddr_t) req;
+    req->sector = sector;
+    req->type = is_write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+
+    // Pick the descriptors for the chain: header, data, status
+    struct virtq_desc *table = indirect ? kmalloc(num_descs * sizeof(*table)) : vq->descs;
+    uint16_t chain[3];
+    for (int i = 0; i < num_descs; i++)
+        chain[i] = indirect ? i : virtq_alloc_desc(vq);
+    for (int i = 0; i < num_descs; i++) {
+        table[chain[i]].flags = i + 1 < num_descs ? VIRTQ_DESC_F_NEXT : 0;
+        table[chain[i]].next = i + 1 < num_descs ? chain[i + 1] : 0;
+    }
+
+    // Request header (type, sector)
+    table[chain[0]].addr = req_paddr;
+    table[chain[0]].len = sizeof(uint32_t) * 2 + sizeof(uint64_t);
+
+    // Data (read or write)
+    table[chain[1]].addr = data_paddr;
+    table[chain[1]].len = len;
+    if (!is_write)
+        table[chain[1]].flags |= VIRTQ_DESC_F_WRITE;
+
+    // Status byte (device writes result here)
+    table[chain[2]].addr = req_paddr + offsetof(struct virtio_blk_req, status);
+    table[chain[2]].len = sizeof(uint8_t);
+    table[chain[2]].flags = VIRTQ_DESC_F_WRITE;
+
+    uint16_t head = chain[0];
+    if (indirect) {
+        head = virtq_alloc_desc(vq);
+        vq->descs[head].addr = (paddr_t) table;
+        vq->descs[head].len = num_descs * sizeof(*table);
+        vq->descs[head].flags = VIRTQ_DESC_F_INDIRECT;
+    }
+
+    blk_inflight[head].req = req;
+    blk_inflight[head].indirect = indirect ? table : NULL;
+    blk_inflight[head].completion = completion;
 
     // Notify device of new request
-    virtq_kick(vq, 0);
+    virtq_kick(vq, head);
+}
 
-    // Wait until device finishes processing (busy-wait)
-    while (virtq_is_busy(vq))
-        ;
+int virtio_blk_wait(struct virtio_blk_completion *completion) {
+    // Other processes run until the device interrupt wakes us
+    while (!completion->done)
+        blk_wait_for_device();
 
-    // Check status: 0 = success, non-zero = error
-    if (blk_req->status != 0) {
-        printf("virtio: warn: failed to read/write sector=%d status=%d\n",
-                sector, blk_req->status);
-        return;
+    // Copy bounced read data back now that we are in the caller's context
+    if (completion->data) {
+        if (completion->buf && completion->status == 0)
+            memcpy(completion->buf, completion->data, completion->len);
+        kfree(completion->data);
+        completion->data = NULL;
     }
 
-    // Copy data from device buffer on reads
-    if (!is_write)
-        memcpy(buf, blk_req->data, SECTOR_SIZE);
-}
\ No newline at end of file
+    return completion->status;
+}
+
+int blk_rw(void *buf, unsigned sector, unsigned count, int is_write) {
+    // Split the range into requests of at most VIRTIO_BLK_MAX_SECTORS and
+    // keep as many in flight as the queue holds
+    struct virtio_blk_completion completions[VIRTQ_ENTRY_NUM];
+    bool pending[VIRTQ_ENTRY_NUM] = {0};
+    int status = 0;
+
+    for (unsigned i = 0, done = 0; done < count; i++) {
+        unsigned slot = i % VIRTQ_ENTRY_NUM;
+        if (pending[slot] && virtio_blk_wait(&completions[slot]) != 0)
+            status = -1;
+
+        unsigned n = count - done;
+        if (n > VIRTIO_BLK_MAX_SECTORS)
+            n = VIRTIO_BLK_MAX_SECTORS;
+        virtio_blk_submit(&completions[slot], (uint8_t *) buf + done * SECTOR_SIZE,
+                          sector + done, n, is_write);
+        pending[slot] = true;
+        done += n;
+    }
+
+    for (unsigned slot = 0; slot < VIRTQ_ENTRY_NUM; slot++) {
+        if (pending[slot] && virtio_blk_wait(&completions[slot]) != 0)
+            status = -1;
+    }
+    return status;
+}
+
+void read_write_disk(void *buf, unsigned sector, int is_write) {
+    blk_rw(buf, sector, 1, is_write);
+}
@@ -9,7 +9,62 @@
 void virtio_blk_init(void);
 
 /**
- * Reads from or writes to the virtio-blk device.
+ * Queues a read or write of consecutive sectors as a single request and
+ * returns without waiting for it. The device transfers directly to or from
+ * buf when it is kernel memory; other buffers go through a bounce buffer
+ * that virtio_blk_wait() copies back and frees, so every submitted request
+ * must be waited for. When the descriptors are all in use, this first
+ * waits for an earlier request to complete.
+ *
+ * @param completion - Marked done once the request finishes; must stay
+ *                     valid until then
+ * @param buf - count * SECTOR_SIZE buffer to read into or write from; must
+ *              stay mapped and unchanged until the request completes
+ * @param sector - First sector to read/write
+ * @param count - Number of sectors, 1 to VIRTIO_BLK_MAX_SECTORS
+ * @param is_write - true for write operation, false for read
+ */
+void virtio_blk_submit(struct virtio_blk_completion *completion, void *buf,
+                       unsigned sector, unsigned count, int is_write);
+
+/**
+ * Processes requests the device has finished, marking their completions
+ * and waking the processes waiting on them.
+ *
+ * @return true if any request completed
+ */
+bool virtio_blk_poll(void);
+
+/**
+ * Handles the virtio-blk interrupt: acknowledges it, processes finished
+ * requests and wakes the processes waiting on them.
+ */
+void virtio_blk_handle_irq(void);
+
+/**
+ * Waits for a submitted request to complete. Processes sleep until the
+ * device interrupt; at boot, with no process to put to sleep, this polls.
+ * Must be called by the process that submitted the request.
+ *
+ * @param completion - Completion passed to virtio_blk_submit()
+ * @return The request status, 0 on success
+ */
+int virtio_blk_wait(struct virtio_blk_completion *completion);
+
+/**
+ * Reads or writes a range of sectors and waits for the result. The range
+ * is sent as few large requests as possible, several in flight at once.
+ *
+ * @param buf - count * SECTOR_SIZE buffer to read into or write from
+ * @param sector - First sector to read/write
+ * @param count - Number of sectors
+ * @param is_write - true for write operation, false for read
+ * @return 0 on success, -1 if any part failed
+ */
+int blk_rw(void *buf, unsigned sector, unsigned count, int is_write);
+
+/**
+ * Reads from or writes to the virtio-blk device and waits for the result.
  *
  * @param buf - Buffer to read into or write from (must be SECTOR_SIZE bytes)
  * @param sector - Sector number to read/write